@@ -0,0 +1,32 @@
+//
+// HousePower MiniBMS Cell Module
+// OpenSource Replacement Firmware
+// Copyright 2021 Martin Bartosch
+//
+// See LICENSE file.
+//
+
+//////////////////////////////////////////////////////////////////////////
+// Bare-metal replacement for the Arduino core
+// The bare-metal build envs (see platformio.ini) put this directory on the
+// include path, so the firmware is compiled against plain avr-libc. Only
+// the few definitions the firmware uses are provided, all timing is done
+// by the firmware itself (output scheduler, watchdog, ADC sleep).
+
+#ifndef BAREMETAL_ARDUINO_H
+#define BAREMETAL_ARDUINO_H
+
+#include <stdint.h>
+#include <avr/io.h>
+#include <avr/interrupt.h>
+
+typedef uint8_t byte;
+
+#define interrupts()   sei()
+#define noInterrupts() cli()
+
+// entry points called by main() (see main.cpp in this directory)
+void setup();
+void loop();
+
+#endif
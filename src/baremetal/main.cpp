@@ -0,0 +1,26 @@
+//
+// HousePower MiniBMS Cell Module
+// OpenSource Replacement Firmware
+// Copyright 2021 Martin Bartosch
+//
+// See LICENSE file.
+//
+
+//////////////////////////////////////////////////////////////////////////
+// Bare-metal startup
+// Replaces the Arduino core main(): no init() (Timer0 millis interrupt,
+// Timer1 and ADC setup), interrupts are enabled before setup() as in the
+// Arduino core. Not compiled for the Arduino envs.
+
+#ifndef ARDUINO
+
+#include <Arduino.h>
+
+int main() {
+  interrupts();
+  setup();
+  for (;;)
+    loop();
+}
+
+#endif
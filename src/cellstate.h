@@ -0,0 +1,387 @@
+//
+// HousePower MiniBMS Cell Module
+// OpenSource Replacement Firmware
+// Copyright 2021 Martin Bartosch
+//
+// See LICENSE file.
+//
+
+//////////////////////////////////////////////////////////////////////////
+// Cell state engine
+// Moving average filter, cell state and shunting decisions and the tracking
+// of recent cutoff events. This part of the firmware does not access any
+// hardware, it is also compiled natively by the host tools (see tools/).
+
+#ifndef CELLSTATE_H
+#define CELLSTATE_H
+
+#include <Arduino.h>
+
+//////////////////////////////////////////////////////////////////////////
+// Moving average
+
+// moving average window of N samples, the running sum of the window must
+// fit into 16 bits for the highest sample value MaxSample
+template <byte N, unsigned int MaxSample>
+struct moving_average_t {
+  static_assert(N * (unsigned long) MaxSample <= 0xffff,
+    "moving average window too large for 16 bit moving average sum");
+
+  unsigned int buffer[N];
+  // running sum of all buffer entries
+  unsigned int sum;
+  byte index;
+};
+
+// calculate moving average
+// replaces the oldest sample in the window and updates the running sum,
+// for a power of two window size the unsigned division compiles to shifts
+template <byte N, unsigned int MaxSample>
+unsigned int moving_average(moving_average_t<N, MaxSample> &avg, unsigned int val) {
+  avg.sum += val - avg.buffer[avg.index];
+  avg.buffer[avg.index++] = val;
+  if (avg.index >= N)
+    avg.index = 0;
+
+  return avg.sum / N;
+}
+
+// fill the whole window with one sample, returns the new moving average
+template <byte N, unsigned int MaxSample>
+unsigned int moving_average_fill(moving_average_t<N, MaxSample> &avg, unsigned int val) {
+  for (byte ii = 0; ii < N; ii++)
+    avg.buffer[ii] = val;
+  avg.sum = N * val;
+  avg.index = 0;
+
+  return val;
+}
+
+//////////////////////////////////////////////////////////////////////////
+// Cell state calculation
+
+// Possible cell states
+enum {
+  e_CellInvalid = 0,
+  e_CellNorm,
+  e_CellLVC,
+  e_CellHVC,
+  e_TOTALCELLSTATES };
+
+// special value indicating that no cutoff has happened recently
+const unsigned int c_NoCutoffEvent = 0xffff;
+
+// threshold invariants: LVC hysteresis below the HVC hysteresis, some hysteresis
+// for all decisions, shunting starts below HVC
+constexpr bool cell_thresholds_valid(unsigned int lv_engage, unsigned int lv_disengage,
+    unsigned int hv_engage, unsigned int hv_disengage,
+    unsigned int shunt_engage, unsigned int shunt_disengage) {
+  return (lv_engage < lv_disengage) && (lv_disengage < hv_disengage) && (hv_disengage < hv_engage) &&
+    (shunt_disengage < shunt_engage) && (shunt_engage < hv_engage);
+}
+
+// cell state engine parameters (voltages in mV, times in s), set at runtime
+// (host tools), thresholds must satisfy cell_thresholds_valid()
+struct cell_params {
+  unsigned int lv_engage;
+  unsigned int lv_disengage;
+  unsigned int hv_engage;
+  unsigned int hv_disengage;
+  unsigned int shunt_engage;
+  unsigned int shunt_disengage;
+  // time a new state needs to be stable before beeing committed
+  unsigned int settle_time;
+  // a cutoff event within this time interval counts as recent
+  unsigned int recent_cutoff_duration;
+  // a single raw sample this far (in mV) beyond the LVC/HVC engage threshold
+  // commits the cutoff immediately, 0 disables the fast trip path
+  unsigned int fast_trip_margin;
+  // shunting starts at shunt_disengage already if the voltage trend reaches
+  // hv_engage within this time (in s), 0 disables the prediction
+  unsigned int trend_horizon;
+};
+
+// cell state engine parameters fixed at compile time (firmware), same members
+// as cell_params, all comparisons are against constants
+template <unsigned int LvEngage, unsigned int LvDisengage,
+  unsigned int HvEngage, unsigned int HvDisengage,
+  unsigned int ShuntEngage, unsigned int ShuntDisengage,
+  unsigned int SettleTime, unsigned int RecentCutoffDuration,
+  unsigned int FastTripMargin, unsigned int TrendHorizon>
+struct cell_profile {
+  static_assert(LvEngage < LvDisengage, "LVC engage threshold must be below LVC disengage threshold");
+  static_assert(LvDisengage < HvDisengage, "LVC thresholds must be below HVC thresholds");
+  static_assert(HvDisengage < HvEngage, "HVC disengage threshold must be below HVC engage threshold");
+  static_assert(ShuntDisengage < ShuntEngage, "shunting disengage threshold must be below shunting engage threshold");
+  static_assert(ShuntEngage < HvEngage, "shunting must start below HVC");
+  static_assert(FastTripMargin < LvEngage, "fast trip margin too large");
+  static_assert(HvEngage + (unsigned long) FastTripMargin <= 0xffff, "fast trip margin too large");
+
+  static constexpr unsigned int lv_engage = LvEngage;
+  static constexpr unsigned int lv_disengage = LvDisengage;
+  static constexpr unsigned int hv_engage = HvEngage;
+  static constexpr unsigned int hv_disengage = HvDisengage;
+  static constexpr unsigned int shunt_engage = ShuntEngage;
+  static constexpr unsigned int shunt_disengage = ShuntDisengage;
+  static constexpr unsigned int settle_time = SettleTime;
+  static constexpr unsigned int recent_cutoff_duration = RecentCutoffDuration;
+  static constexpr unsigned int fast_trip_margin = FastTripMargin;
+  static constexpr unsigned int trend_horizon = TrendHorizon;
+};
+
+// voltage bands separated by the LVC/HVC thresholds
+enum {
+  e_BandLVC = 0,   // v <= lv_engage
+  e_BandLow,       // lv_engage < v <= lv_disengage
+  e_BandNorm,      // lv_disengage < v < hv_disengage
+  e_BandHigh,      // hv_disengage <= v < hv_engage
+  e_BandHVC,       // v >= hv_engage
+  e_TOTALBANDS };
+
+// voltage bands separated by the shunting thresholds
+enum {
+  e_ShuntBandOff = 0,  // v < shunt_disengage
+  e_ShuntBandKeep,     // shunt_disengage <= v <= shunt_engage
+  e_ShuntBandOn,       // v > shunt_engage
+  e_TOTALSHUNTBANDS };
+
+template <class P>
+inline byte voltage_band(const P &p, unsigned int v) {
+  return (v > p.lv_engage) + (v > p.lv_disengage) + (v >= p.hv_disengage) + (v >= p.hv_engage);
+}
+
+template <class P>
+inline byte shunt_band(const P &p, unsigned int v) {
+  return (v >= p.shunt_disengage) + (v > p.shunt_engage);
+}
+
+// new cell state for the current state and voltage band
+// LVC is kept up to the upper LVC threshold and HVC down to the lower HVC
+// threshold, all other states (including the invalid state after boot)
+// become normal within the hysteresis bands
+constexpr byte cell_transition(byte state, byte band) {
+  return (band == e_BandLVC) ? e_CellLVC :
+    (band == e_BandHVC) ? e_CellHVC :
+    ((band == e_BandLow) && (state == e_CellLVC)) ? e_CellLVC :
+    ((band == e_BandHigh) && (state == e_CellHVC)) ? e_CellHVC :
+    e_CellNorm;
+}
+
+#define CELL_TRANSITIONS(state) { \
+  cell_transition(state, e_BandLVC), cell_transition(state, e_BandLow), \
+  cell_transition(state, e_BandNorm), cell_transition(state, e_BandHigh), \
+  cell_transition(state, e_BandHVC) }
+
+const byte c_CellTransition[e_TOTALCELLSTATES][e_TOTALBANDS] PROGMEM = {
+  CELL_TRANSITIONS(e_CellInvalid),
+  CELL_TRANSITIONS(e_CellNorm),
+  CELL_TRANSITIONS(e_CellLVC),
+  CELL_TRANSITIONS(e_CellHVC) };
+
+// new shunting state for the current shunting state and shunting band
+constexpr bool shunt_transition(bool shunting, byte band) {
+  return (band == e_ShuntBandOn) || ((band == e_ShuntBandKeep) && shunting);
+}
+
+// shunting transitions as bit mask, bit (2 * band + shunting)
+const byte c_ShuntTransition =
+  (shunt_transition(false, e_ShuntBandOff)  << 0) | (shunt_transition(true, e_ShuntBandOff)  << 1) |
+  (shunt_transition(false, e_ShuntBandKeep) << 2) | (shunt_transition(true, e_ShuntBandKeep) << 3) |
+  (shunt_transition(false, e_ShuntBandOn)   << 4) | (shunt_transition(true, e_ShuntBandOn)   << 5);
+
+struct cell_engine {
+  // averaged cell voltage (mV)
+  unsigned int cellvoltage;
+
+  // current cell state
+  byte cellstate;
+  // tentative new cell state
+  byte cellstate_pending;
+  // age (in s) of the pending new state
+  unsigned int cellstate_pending_age;
+
+  // shunting state
+  bool shunting;
+  bool shunting_pending;
+  // age (in s) of the pending new shunting state
+  unsigned int shunting_pending_age;
+
+  // age (in s) of last HVC or LVC event
+  unsigned int last_cutoff_age;
+
+  // voltage trend (in 1/256 mV/s) and the averaged cell voltage of the
+  // previous trend update
+  int trend;
+  unsigned int trend_voltage;
+};
+
+// trend filter: exponential moving average of the per cycle slope with a
+// weight of 1/2^c_TrendShift for the new slope
+const byte c_TrendShift = 5;
+// largest voltage step (mV) per cycle accepted by the trend filter
+const int c_TrendMaxStep = 127;
+
+// initialize engine with the given (averaged) cell voltage, cell state is invalid
+inline void cell_init(cell_engine &e, unsigned int cellvoltage) {
+  e.cellvoltage = cellvoltage;
+  e.cellstate = e_CellInvalid;
+  e.cellstate_pending = e_CellInvalid;
+  e.cellstate_pending_age = 0;
+  e.shunting = false;
+  e.shunting_pending = false;
+  e.shunting_pending_age = 0;
+  e.last_cutoff_age = 0;
+  e.trend = 0;
+  e.trend_voltage = cellvoltage;
+}
+
+// advance age of last cutoff event by elapsed seconds, saturates at c_NoCutoffEvent
+inline void cell_age(cell_engine &e, byte elapsed) {
+  if (e.last_cutoff_age > c_NoCutoffEvent - elapsed)
+    e.last_cutoff_age = c_NoCutoffEvent;
+  else
+    e.last_cutoff_age += elapsed;
+}
+
+// update the voltage trend with the averaged cell voltage, elapsed is the time
+// (in s) since the previous call
+inline void cell_trend(cell_engine &e, byte elapsed) {
+  // a cycle shorter than 1 s keeps the reference, its step is part of the
+  // next interval
+  if (! elapsed)
+    return;
+  int step = (int) e.cellvoltage - (int) e.trend_voltage;
+  e.trend_voltage = e.cellvoltage;
+
+  if (step > c_TrendMaxStep)
+    step = c_TrendMaxStep;
+  else if (step < -c_TrendMaxStep)
+    step = -c_TrendMaxStep;
+  int slope = (step * 256) / elapsed;
+  // slope - trend spans +-2 * 127 * 256, beyond a 16 bit int
+  e.trend += (int) (((long) slope - e.trend) >> c_TrendShift);
+}
+
+// returns true if the voltage trend reaches the HVC threshold within the
+// trend horizon (for a power of two horizon the multiplication is a shift)
+template <class P>
+inline bool cell_trend_hvc(const cell_engine &e, const P &p) {
+  return p.trend_horizon && (e.trend > 0) &&
+    (e.cellvoltage + (((unsigned long) e.trend * p.trend_horizon) >> 8) >= p.hv_engage);
+}
+
+// shunt duty cycle (in %) for proportional balancing: min_duty at the
+// shunting engage threshold rising linearly to 100 % at full_voltage, fully
+// on while the trend predicts HVC
+template <class P>
+inline byte cell_shunt_duty(const cell_engine &e, const P &p, byte min_duty, unsigned int full_voltage) {
+  if ((e.cellvoltage >= full_voltage) || cell_trend_hvc(e, p))
+    return 100;
+  if (e.cellvoltage <= p.shunt_engage)
+    return min_duty;
+  return min_duty + ((100 - min_duty) * (e.cellvoltage - p.shunt_engage)) / (full_voltage - p.shunt_engage);
+}
+
+// determine new cell and shunting state from the averaged cell voltage,
+// elapsed is the time (in s) since the previous call
+template <class P>
+inline void determine_cellstate(cell_engine &e, const P &p, byte elapsed) {
+  const unsigned int cellvoltage = e.cellvoltage;
+
+  byte cellstate_new = pgm_read_byte(&c_CellTransition[e.cellstate][voltage_band(p, cellvoltage)]);
+  byte sband = shunt_band(p, cellvoltage);
+  // predictive balancing: start within the shunting hysteresis if HVC is near
+  if ((sband == e_ShuntBandKeep) && cell_trend_hvc(e, p))
+    sband = e_ShuntBandOn;
+  bool shunting_new = (c_ShuntTransition >> (2 * sband + e.shunting)) & 1;
+
+  if (e.shunting_pending != shunting_new) {
+    e.shunting_pending = shunting_new;
+    e.shunting_pending_age = 0;
+  } else {
+    if (e.shunting_pending_age > p.settle_time) {
+      e.shunting = shunting_new;
+    } else {
+      e.shunting_pending_age += elapsed;
+    }
+  }
+
+
+  if (e.cellstate_pending != cellstate_new) {
+    e.cellstate_pending = cellstate_new;
+    e.cellstate_pending_age = 0;
+  } else {
+    if (e.cellstate_pending_age > p.settle_time) {
+      e.cellstate = cellstate_new;
+    } else {
+      e.cellstate_pending_age += elapsed;
+    }
+  }
+}
+
+// returns true if the raw (unfiltered) sample is beyond the engage threshold
+// by more than the fast trip margin
+template <class P>
+inline bool cell_fast_trip_due(const P &p, unsigned int raw) {
+  return p.fast_trip_margin &&
+    ((raw + p.fast_trip_margin <= p.lv_engage) || (raw >= p.hv_engage + p.fast_trip_margin));
+}
+
+// fast trip path on the raw (unfiltered) sample: commit LVC/HVC immediately
+// if the sample is beyond the engage threshold by more than the fast trip
+// margin, returns true if the state was forced (the caller then reseeds the
+// filter with the sample so the slow path holds the cutoff)
+template <class P>
+inline bool cell_fast_trip(cell_engine &e, const P &p, unsigned int raw) {
+  byte cellstate_new;
+
+  if (! cell_fast_trip_due(p, raw))
+    return false;
+  if (raw + p.fast_trip_margin <= p.lv_engage)
+    cellstate_new = e_CellLVC;
+  else if (raw >= p.hv_engage + p.fast_trip_margin)
+    cellstate_new = e_CellHVC;
+  else
+    return false;
+
+  if ((e.cellstate == cellstate_new) && (e.cellstate_pending == cellstate_new))
+    return false;
+
+  e.cellstate = cellstate_new;
+  e.cellstate_pending = cellstate_new;
+  e.cellstate_pending_age = 0;
+  return true;
+}
+
+// commit the state for the current (averaged) cell voltage without waiting
+// for the settle time, used at boot after seeding the filter with measurements
+template <class P>
+inline void cell_boot(cell_engine &e, const P &p) {
+  determine_cellstate(e, p, 0);
+  e.trend_voltage = e.cellvoltage;
+  e.cellstate = e.cellstate_pending;
+  e.shunting = e.shunting_pending;
+}
+
+// update age of last cutoff event for the current cell state
+// returns true in normal state if a HVC or LVC happened recently
+template <class P>
+inline bool update_cutoff_age(cell_engine &e, const P &p) {
+  switch (e.cellstate) {
+  case e_CellLVC:
+  case e_CellHVC:
+    e.last_cutoff_age = 0;
+    break;
+  case e_CellNorm:
+    if (e.last_cutoff_age < p.recent_cutoff_duration) {
+      // recent HVC/LVC happened
+      return true;
+    }
+    // normal state has been stable for some time
+    e.last_cutoff_age = c_NoCutoffEvent;
+    break;
+  }
+  return false;
+}
+
+#endif
@@ -10,6 +10,11 @@
 #include <avr/power.h>
 #include <avr/wdt.h>
 #include <avr/sleep.h>
+#include <avr/pgmspace.h>
+#include <avr/eeprom.h>
+#include <util/crc16.h>
+
+#include "cellstate.h"
 
 //////////////////////////////////////////////////////////////////////////
 // If the CALIBRATION_MODE flag is defined the firmware is stripped down to the following 
@@ -21,22 +26,87 @@
 // #define CALIBRATION_MODE
 
 // HOW TO CALIBRATE:
-// 1. attach RXD of a terminal program on the host computer (9600 Baud 8N1) to PB2 (pin 7) of the ATTiny
+// 1. attach RXD of a serial adapter (9600 Baud 8N1) to PB1 (pin 6) of the ATTiny, start tools/telemetry
 // 2. compile and deploy this source with CALIBRATION_MODE enabled
 // 3. attach stable power supply to cell board Vcc, voltage should be about 3.1 - 3.4 V
 // 4. WAIT AT LEAST 8 SECONDS BEFORE TAKING MEASUREMENTS
 // 5. attach a precise volt meter as close as possible to Vcc/GND of cell board
 // 6. take voltage reading on volt meter, note as "voltage metered"
-// 7. check value of "Vcc (uncalibrated)" output on the terminal console, note as "voltage software"
+// 7. check value of "Vcc (uncalibrated)" output of the telemetry decoder, note as "voltage software"
 // 8. insert these two values (measured in mV) in the below constants calibration_voltage_metered and calibration_voltage_software
 // 9. disable CALIBRATION_MODE
 // 10. compile and deploy the calibrated source to this particular cell module
 
 // NOTE: Calibration is for one particular ATTiny processor and must be repeated for each module to be deployed!
 
-// enable debugging console output on PB2/Pin 7 (may require ATTTiny85 due to flash size requirements)
+// self calibration: a module without calibration record in the EEPROM that
+// is powered from a c_CalibrationReference supply at boot measures its own
+// calibration factor and stores it in the EEPROM. The stored factor replaces
+// calibration_factor_custom, one firmware image serves all modules.
+// #define SELF_CALIBRATION
+
+// enable binary telemetry frames (9600 Baud 8N1) on PB1/Pin 6 (shared with the LED),
+// decode with tools/telemetry
 // #define DEBUG
 
+// optical readout: the telemetry frames (boot, status, calibration, event log,
+// profiling counters) are sent Manchester coded via the LED at boot and every
+// c_OpticalInterval, readable with a phototransistor probe (see Telemetry)
+// #define OPTICAL
+
+// proportional balancing: drive the shunt with a hardware PWM (Timer1) whose
+// duty cycle increases with the cell voltage above c_ShuntVoltage_engage
+// #define SHUNT_PWM
+
+// take an additional measurement while the shunt is on, estimate balancing
+// current, power and cell internal resistance (reported via telemetry)
+// #define SHUNT_MEASUREMENT
+
+// profiling: count awake time (Timer1), power down time and wakeups per cell
+// state and the time spent in readADC() and determine_cellstate(), the
+// counters are reported via telemetry (requires DEBUG, uses Timer1)
+// #define PROFILE
+
+// drive PIN_AUX high while the CPU is not in power down mode, allows
+// measuring the awake time with a scope
+// #define PROFILE_PIN
+
+// daisy chained cell bus: PB0 (pin 5) receives from the previous module,
+// PIN_AUX (PB2, pin 7) sends to the next module, the host reads the voltage
+// and state of all modules of the pack (uses Timer1)
+// #define CELL_BUS
+
+// measure the chip temperature (internal sensor, ADC4) every
+// c_TemperatureInterval seconds, inhibit shunting above c_ShuntMaxTemperature
+// (reported via telemetry, ATtiny25/45/85 only)
+// #define TEMPERATURE
+
+// run computations (Vcc conversion, cell state engine, shunt measurement) at
+// 8 MHz and drop back to F_CPU before anything timed runs (requires 1 MHz
+// from the 8 MHz internal oscillator with CKDIV8, see Clock bursts)
+// #define CLOCK_BURST
+
+// loop warning pulses: the loop is opened for 100 ms in each cycle while
+// shunting and while the cell voltage is at or below c_LoopWarningVoltage,
+// allows the main board to reduce the charge/discharge current before a
+// cutoff (the main board must tolerate the pulses)
+// #define LOOP_WARNING
+
+// persistent event log in EEPROM: boot, cell state transitions and the
+// min/max cell voltage, read out via telemetry at boot (see Event log)
+// #define EVENT_LOG
+
+// lifetime statistics: time per voltage band, per cell state and shunting,
+// number of LVC/HVC entries, stored in EEPROM by the event log and reported
+// via telemetry (requires EVENT_LOG, see Statistics)
+// #define STATISTICS
+
+// transient capture: a measurement deviating from the averaged cell voltage
+// arms a high rate Vcc capture (c_CaptureRate) with pre- and post-trigger
+// history, sent via telemetry when complete (requires DEBUG, see Transient
+// capture)
+// #define CAPTURE
+
 //////////////////////////////////////////////////////////////////////////
 // USER CONFIGURATION
 // CHANGE THESE VALUES ACCORDING TO THE CALIBRATION RESULTS
@@ -47,6 +117,13 @@ const unsigned long calibration_voltage_metered = 3200;
 // Voltage (mV) reported in CALIBRATION_MODE (Vcc uncalibrated output)
 const unsigned long calibration_voltage_software = 3200;
 
+// self calibration (SELF_CALIBRATION): voltage (mV) of the reference supply,
+// the uncalibrated measurement at boot must be within c_CalibrationWindow %
+// of this voltage to start a self calibration (the window must be above any
+// cell voltage, a module on a cell never calibrates itself)
+const unsigned int c_CalibrationReference = 4200;
+const byte c_CalibrationWindow = 8;
+
 // ONLY CHANGE THE BELOW VALUES IF YOU KNOW WHAT YOU ARE DOING
 // cell module voltage thresholds (in mV)
 const int c_LVoltage_engage    = 2900L;
@@ -58,17 +135,94 @@ const int c_HVoltage_disengage = 3550L;
 const int c_ShuntVoltage_engage    = 3500L;
 const int c_ShuntVoltage_disengage = 3450L;
 
+// shunt PWM (SHUNT_PWM): duty cycle (in %) at c_ShuntVoltage_engage, the duty
+// cycle increases linearly up to 100 % at c_ShuntPwmFullVoltage (mV)
+const byte c_ShuntPwmMinDuty = 25;
+const int c_ShuntPwmFullVoltage = c_HVoltage_disengage;
+
+// shunt measurement (SHUNT_MEASUREMENT): resistance (in mOhm) of the balancing
+// shunt (R5 || R6 plus MOSFET) and of the module series resistor R1
+const unsigned int c_ShuntResistance  = 5000;
+const unsigned int c_SeriesResistance = 390;
+
 // number of voltage measurements to average
 const byte c_MovingAverageWindow = 5;
 
-// number of consecutive measurements (~1 s cycle time) a new state needs 
-// to be stable before beeing committed
+// ADC oversampling: time budget (in us) per measurement cycle for ADC
+// conversions in noise reduction mode. The largest burst of 4^n conversions
+// fitting into this budget is taken each cycle and decimated to n extra bits
+// of resolution (n <= 3). 0 disables oversampling.
+const unsigned int c_AdcBurstBudget = 1000;
+
+// time (in s) a new state needs to be stable before beeing committed
 const unsigned int c_StateSettleTime = 3;
 
+// fast trip: a single raw measurement this far (in mV) below c_LVoltage_engage
+// or above c_HVoltage_engage commits the cutoff in the same cycle, bypassing
+// the moving average and c_StateSettleTime (0 disables the fast trip path)
+const unsigned int c_FastTripMargin = 200;
+
+// predictive balancing: shunting starts at c_ShuntVoltage_disengage already
+// while the voltage trend (rise rate of the averaged cell voltage) reaches
+// c_HVoltage_engage within this time (in s, a power of two is cheapest),
+// with SHUNT_PWM the shunt is fully on meanwhile (0 disables the prediction)
+const unsigned int c_TrendHorizon = 512;
+
+// event log (EVENT_LOG): interval (in s, 6 hours) for writing a new record
+// if the min/max cell voltage has changed without a cell state transition
+const unsigned long c_LogInterval = 6UL * 60 * 60;
+
+// statistics (STATISTICS): lower bound (mV) of the first voltage band, band
+// width (2^c_StatisticsBandShift mV, 64 mV) and number of bands (the first and
+// last band also count the voltages beyond)
+const unsigned int c_StatisticsMin = 2800;
+const byte c_StatisticsBandShift = 6;
+const byte c_StatisticsBands = 16;
+
+// loop warning (LOOP_WARNING): cell voltage (mV) below which the normal state
+// pulses the loop (approaching LVC)
+const unsigned int c_LoopWarningVoltage = 3000;
+
+// transient capture (CAPTURE): a measurement this far (in mV) from the
+// averaged cell voltage arms the capture for c_CaptureArmTime (in s), a
+// captured sample this far away triggers it. Samples per second (100 - 1000),
+// ring size (a quarter of the RAM, ATtiny85: 128, ATtiny45: 64) and samples
+// after the trigger.
+const unsigned int c_CaptureThreshold = 100;
+const unsigned int c_CaptureArmTime = 60;
+const unsigned int c_CaptureRate = 500;
+const byte c_CaptureSamples = ((RAMEND + 1 - RAMSTART) >= 512) ? 128 : 64;
+const byte c_CapturePostTrigger = c_CaptureSamples * 3 / 4;
+
+// optical readout (OPTICAL): interval (in s, 10 minutes) for repeating the
+// readout in normal state (0: at boot only)
+const unsigned int c_OpticalInterval = 10 * 60;
+
 // special handling/notification if LVC or HVC happened within this 
-// time interval (~30 minutes)
+// time interval (in s, 30 minutes)
 const unsigned int c_RecentCutOffDuration = 30 * 60;
 
+// interval (in s, 15 minutes) for measuring the watchdog oscillator against
+// the system clock, the watchdog timeouts drift with voltage and temperature
+const unsigned int c_WdtCalibrationInterval = 15 * 60;
+
+// adaptive measurement period: in normal state (not shunting, no pending 
+// state change) the cycle time is doubled (2 s, 4 s, up to 8 s) for each 
+// multiple of this distance (in mV) between the cell voltage and the nearest 
+// LVC, shunting or HVC threshold
+const unsigned int c_AdaptivePeriodStep = 50;
+
+// chip temperature (TEMPERATURE): sampling interval (in s), ADC value of the
+// internal temperature sensor at 0 °C (1 LSB ~ 1 °C, typical value, the
+// offset of an individual chip may differ by +-10 °C)
+const unsigned int c_TemperatureInterval = 64;
+const int c_TemperatureOffset = 273;
+
+// no shunting at or above this chip temperature (in °C, TEMPERATURE), shunting
+// resumes below c_ShuntMaxTemperature - c_TemperatureHysteresis
+const int c_ShuntMaxTemperature = 60;
+const int c_TemperatureHysteresis = 5;
+
 // END OF USER CONFIGURATION
 //////////////////////////////////////////////////////////////////////////
 
@@ -77,9 +231,53 @@ const unsigned long calibration_factor_custom = ((1024UL * 11 * 1000) / (10 * ca
 // default value used for calibration
 const unsigned long calibration_factor_default = ((1024UL * 11 * 1000) / (10 * 3200L)) * 3200UL;
 
-// Averaged cell voltage, start with a sensible and likely value
+// cell state engine parameters, the thresholds are compiled into the state
+// engine as constants and checked at compile time (see cellstate.h)
+typedef cell_profile<
+  c_LVoltage_engage, c_LVoltage_disengage,
+  c_HVoltage_engage, c_HVoltage_disengage,
+  c_ShuntVoltage_engage, c_ShuntVoltage_disengage,
+  c_StateSettleTime, c_RecentCutOffDuration,
+  c_FastTripMargin, c_TrendHorizon> cell_thresholds;
+const cell_thresholds c_CellParams = {};
+
+// cell state engine, start with a sensible and likely averaged cell voltage (mV)
 // (will be averaged over c_MovingAverageWindow values)
-long cellvoltage = 3200;
+cell_engine cell = { 3200, e_CellInvalid, e_CellInvalid, 0, false, false, 0, 0, 0, 3200 };
+
+#if defined(PROFILE) && !defined(DEBUG) && !defined(OPTICAL)
+#error "PROFILE requires DEBUG or OPTICAL"
+#endif
+#if defined(PROFILE) && defined(SHUNT_PWM)
+#error "PROFILE and SHUNT_PWM both use Timer1"
+#endif
+#if defined(CELL_BUS) && (defined(SHUNT_PWM) || defined(PROFILE))
+#error "CELL_BUS uses Timer1, cannot be combined with SHUNT_PWM or PROFILE"
+#endif
+#if defined(CELL_BUS) && defined(PROFILE_PIN)
+#error "CELL_BUS and PROFILE_PIN both use PIN_AUX"
+#endif
+#if defined(CELL_BUS) && defined(CALIBRATION_MODE)
+#error "CELL_BUS is not available in CALIBRATION_MODE"
+#endif
+#if defined(CLOCK_BURST) && defined(CELL_BUS)
+#error "CLOCK_BURST cannot be combined with CELL_BUS (asynchronous Timer1 bit timing)"
+#endif
+#if defined(SELF_CALIBRATION) && defined(CALIBRATION_MODE)
+#error "SELF_CALIBRATION replaces CALIBRATION_MODE"
+#endif
+#if defined(EVENT_LOG) && defined(CALIBRATION_MODE)
+#error "EVENT_LOG is not available in CALIBRATION_MODE"
+#endif
+#if defined(STATISTICS) && !defined(EVENT_LOG)
+#error "STATISTICS requires EVENT_LOG"
+#endif
+#if defined(CAPTURE) && (!defined(DEBUG) || defined(CALIBRATION_MODE))
+#error "CAPTURE requires DEBUG and is not available in CALIBRATION_MODE"
+#endif
+#if defined(TEMPERATURE) && !(defined(__AVR_ATtiny25__) || defined(__AVR_ATtiny45__) || defined(__AVR_ATtiny85__))
+#error "TEMPERATURE is only supported on ATtiny25/45/85"
+#endif
 
 //////////////////////////////////////////////////////////////////////////
 // Hardware setup
@@ -99,13 +297,8 @@ long cellvoltage = 3200;
 #define LOOP_CLOSE PORTB |=  (1 << PIN_LOOP)
 #define LOOP_OPEN  PORTB &= ~(1 << PIN_LOOP)
 
-#ifdef DEBUG
-  #define PIN_TX        PIN_AUX
-  #include <SoftwareSerial.h>
-  SoftwareSerial mySerial(-1, PIN_TX);  //rx, tx
-  #define debugln(x) mySerial.println(x)
-  #define debug(x) mySerial.print(x)
-#endif
+#define AUX_HIGH PORTB |=  (1 << PIN_AUX)
+#define AUX_LOW  PORTB &= ~(1 << PIN_AUX)
 
 //////////////////////////////////////////////////////////////////////////
 // Commonly used watchdog timeouts
@@ -115,6 +308,303 @@ long cellvoltage = 3200;
 #define WD_TIMEOUT_500ms (_BV(WDP2) | _BV(WDP0))
 #define WD_TIMEOUT_1000ms (_BV(WDP2) | _BV(WDP1))
 #define WD_TIMEOUT_2000ms (_BV(WDP2) | _BV(WDP1) | _BV(WDP0))
+#define WD_TIMEOUT_4000ms _BV(WDP3)
+#define WD_TIMEOUT_8000ms (_BV(WDP3) | _BV(WDP0))
+
+// prescaler (WDP3:0, 0 = 16 ms ... 9 = 8 s) of the given watchdog timeout
+inline byte wdt_prescaler(byte duration) {
+  return (duration & 0b00000111) | ((duration & _BV(WDP3)) ? 0b00001000 : 0);
+}
+
+//////////////////////////////////////////////////////////////////////////
+// Cell bus
+// Daisy chained, optically isolated bus for reading all modules of a pack.
+// PIN_BUS_RX reads the optocoupler of the previous module (pull-up, low =
+// active), PIN_BUS_TX drives the optocoupler LED of the next module (high =
+// active). UART frames (2400 Baud 8N1, active = space) are forwarded edge
+// by edge by the pin change interrupt, so the previous modules' records
+// pass through with a small constant delay.
+//
+// A read is started by the host with a break (line active for 14 bit times
+// or longer). A module receiving a break appends its own record followed by
+// a break, the next module then does the same:
+//
+//   host:      break
+//   module 1:  [record 1] break
+//   module 2:  [record 1] [record 2] break ...
+//
+// Forwarded active periods are cut after 11 bit times, so a break only
+// ever reaches the next module. Active periods of 10 bit times or more are
+// counted during a read, module n sees n of them (n - 1 cut breaks and the
+// final break) and uses the count as its position in the chain.
+// Record: position, averaged cell voltage (mV, 16 bit little endian),
+// status (bits 0-1: cell state, bit 2: shunting, bit 3: state change
+// pending), CRC8 (Dallas/Maxim) over the first four bytes.
+//
+// The module sleeps in power down mode unless a read is in progress. From
+// the first edge until the line has been idle for ~20 bit times Timer1
+// times the bits and the CPU sleeps in idle mode only.
+
+#ifdef CELL_BUS
+#define PIN_BUS_RX PB0
+#define PIN_BUS_TX PIN_AUX
+
+#define BUS_TX_ACTIVE PORTB |=  (1 << PIN_BUS_TX)
+#define BUS_TX_IDLE   PORTB &= ~(1 << PIN_BUS_TX)
+#define BUS_RX_ACTIVE bit_is_clear(PINB, PIN_BUS_RX)
+
+#define BUS_BAUD 2400UL
+
+// Timer1 clock select (~13 ticks per bit)
+#if F_CPU <= 1600000L
+#define BUS_PRESCALER 32
+#define BUS_CS        (_BV(CS12) | _BV(CS11))
+#elif F_CPU <= 3200000L
+#define BUS_PRESCALER 64
+#define BUS_CS        (_BV(CS12) | _BV(CS11) | _BV(CS10))
+#elif F_CPU <= 6400000L
+#define BUS_PRESCALER 128
+#define BUS_CS        _BV(CS13)
+#else
+#define BUS_PRESCALER 256
+#define BUS_CS        (_BV(CS13) | _BV(CS10))
+#endif
+
+// timing (in Timer1 ticks)
+const byte c_BusBitTicks = (F_CPU / BUS_PRESCALER + BUS_BAUD / 2) / BUS_BAUD;
+// active period counted as break (cut or not)
+const byte c_BusLongActive = 10 * c_BusBitTicks;
+// forwarded active periods are cut after this time
+const byte c_BusCut = 11 * c_BusBitTicks;
+// break detection
+const byte c_BusBreak = 14 * c_BusBitTicks;
+// end of read: line idle for this time
+const byte c_BusIdleTimeout = 255;
+// length (in bits) of the break sent after the own record
+const byte c_BusBreakBits = 28;
+
+static_assert(14UL * ((F_CPU / BUS_PRESCALER + BUS_BAUD / 2) / BUS_BAUD) < 256,
+  "cell bus break detection exceeds Timer1 range");
+
+enum {
+  e_BusOff = 0,   // no read in progress, Timer1 stopped
+  e_BusIdle,      // line idle, waiting for the next edge or the timeout
+  e_BusActive,    // line active, measuring the active period
+  e_BusTx };      // sending own record
+
+volatile byte bus_state = e_BusOff;
+// stage of the current active period (0: < 10 bits, 1: counted, 2: cut)
+volatile byte bus_stage;
+// number of long active periods during the current read
+volatile byte bus_breaks;
+
+// record data, published by the main loop
+volatile unsigned int bus_voltage = 0;
+volatile byte bus_status = e_CellInvalid;
+
+byte bus_record[5];
+// transmit position: current byte, bit within the byte (0: start bit, 9: stop bit)
+byte bus_tx_byte;
+byte bus_tx_bit;
+byte bus_tx_shift;
+
+void bus_init() {
+  DDRB &= ~_BV(PIN_BUS_RX);
+  PORTB |= _BV(PIN_BUS_RX);     // pull-up
+  DIDR0 &= ~_BV(AIN0D);         // enable digital input buffer
+  BUS_TX_IDLE;
+
+  PCMSK = _BV(PIN_BUS_RX);
+  GIFR = _BV(PCIF);
+  GIMSK |= _BV(PCIE);
+}
+
+// publish the current cell state for the next read
+void bus_publish() {
+  byte status = cell.cellstate | (cell.shunting ? 0x04 : 0) |
+    ((cell.cellstate_pending != cell.cellstate) ? 0x08 : 0);
+  noInterrupts();
+  bus_voltage = cell.cellvoltage;
+  bus_status = status;
+  interrupts();
+}
+
+// a read is in progress, Timer1 must keep running (no power down)
+inline bool bus_busy() {
+  return bus_state != e_BusOff;
+}
+
+// program the next Timer1 compare match relative to the current time
+inline void bus_timeout(byte ticks) {
+  OCR1A = TCNT1 + ticks;
+  TIFR = _BV(OCF1A);
+}
+
+// start sending own record (called from the interrupt, line is active)
+void bus_tx_start() {
+  bus_record[0] = bus_breaks;
+  bus_record[1] = bus_voltage & 0xff;
+  bus_record[2] = bus_voltage >> 8;
+  bus_record[3] = bus_status;
+  byte crc = 0;
+  for (byte ii = 0; ii < 4; ii++)
+    crc = _crc_ibutton_update(crc, bus_record[ii]);
+  bus_record[4] = crc;
+
+  bus_tx_byte = 0;
+  bus_tx_bit = 0;
+  bus_tx_shift = bus_record[0];
+  bus_state = e_BusTx;
+
+  // one idle bit before the first start bit
+  BUS_TX_IDLE;
+  OCR1A += c_BusBitTicks;
+}
+
+// send next bit (called from the Timer1 compare match interrupt)
+void bus_tx_next() {
+  OCR1A += c_BusBitTicks;
+
+  if (bus_tx_byte < sizeof(bus_record)) {
+    if (bus_tx_bit == 0) {
+      BUS_TX_ACTIVE;             // start bit
+    } else if (bus_tx_bit <= 8) {
+      if (bus_tx_shift & 1)
+        BUS_TX_IDLE;
+      else
+        BUS_TX_ACTIVE;
+      bus_tx_shift >>= 1;
+    } else {
+      BUS_TX_IDLE;               // stop bit
+      bus_tx_bit = 0;
+      if (++bus_tx_byte < sizeof(bus_record))
+        bus_tx_shift = bus_record[bus_tx_byte];
+      return;
+    }
+    bus_tx_bit++;
+    return;
+  }
+
+  // break
+  if (bus_tx_bit < c_BusBreakBits) {
+    BUS_TX_ACTIVE;
+    bus_tx_bit++;
+    return;
+  }
+  BUS_TX_IDLE;
+  // the input is forwarded again with the next edge
+  bus_state = e_BusIdle;
+  bus_timeout(c_BusIdleTimeout);
+}
+
+// pin change interrupt (executed on every edge of PIN_BUS_RX)
+ISR (PCINT0_vect) {
+  if (bus_state == e_BusTx)
+    return;
+
+  if (bus_state == e_BusOff) {
+    // start of a read
+    bus_breaks = 0;
+    power_timer1_enable();
+    TCNT1 = 0;
+    TCCR1 = BUS_CS;
+    TIMSK |= _BV(OCIE1A);
+  }
+
+  // forward edge
+  if (BUS_RX_ACTIVE) {
+    BUS_TX_ACTIVE;
+    bus_state = e_BusActive;
+    bus_stage = 0;
+    bus_timeout(c_BusLongActive);
+  } else {
+    BUS_TX_IDLE;
+    bus_state = e_BusIdle;
+    bus_timeout(c_BusIdleTimeout);
+  }
+}
+
+// Timer1 compare match interrupt (bit timing)
+ISR (TIMER1_COMPA_vect) {
+  switch (bus_state) {
+  case e_BusActive:
+    if (bus_stage == 0) {
+      // long active period: cut break or break
+      bus_breaks++;
+      bus_stage = 1;
+      OCR1A += c_BusCut - c_BusLongActive;
+    } else if (bus_stage == 1) {
+      // do not forward breaks
+      BUS_TX_IDLE;
+      bus_stage = 2;
+      OCR1A += c_BusBreak - c_BusCut;
+    } else {
+      // break received, append own record
+      bus_tx_start();
+    }
+    break;
+  case e_BusTx:
+    bus_tx_next();
+    break;
+  default:
+    // line idle, read complete
+    TIMSK &= ~_BV(OCIE1A);
+    TCCR1 = 0;
+    power_timer1_disable();
+    bus_state = e_BusOff;
+  }
+}
+#endif
+
+#ifdef CLOCK_BURST
+//////////////////////////////////////////////////////////////////////////
+// Clock bursts
+// F_CPU is the 8 MHz internal oscillator divided by 8 (CKDIV8 fuse). Pure
+// computations run at the full 8 MHz (race to sleep) and the clock drops
+// back to F_CPU afterwards. Bursts never contain anything timed: the output
+// scheduler, telemetry, ADC conversions and sleeps always run at F_CPU, so
+// their prescalers and baud rates stay unchanged. Only the PROFILE tick
+// counter (Timer1) keeps running across a burst, its prescaler is switched
+// along with the clock to keep the tick length.
+
+#if F_CPU != 1000000L
+#error "CLOCK_BURST requires F_CPU 1 MHz (8 MHz internal oscillator with CKDIV8)"
+#endif
+
+// the ATtiny25V/45V/85V needs at least 2.7 V at 8 MHz
+const unsigned int c_ClockBurstMinVoltage = 2800;
+
+// bursts allowed, the cell voltage is known and high enough (see power_policy())
+bool clock_burst_ok = false;
+// burst running
+bool clock_burst = false;
+
+inline void clock_burst_begin() {
+  if (! clock_burst_ok)
+    return;
+  clock_prescale_set(clock_div_1);
+#ifdef PROFILE
+  TCCR1 = _BV(CS13) | _BV(CS11);              // CK/512 at 8 MHz
+#endif
+  clock_burst = true;
+}
+
+inline void clock_burst_end() {
+  if (! clock_burst)
+    return;
+#ifdef PROFILE
+  TCCR1 = _BV(CS12) | _BV(CS11) | _BV(CS10);  // CK/64 at 1 MHz
+#endif
+  clock_prescale_set(clock_div_8);
+  clock_burst = false;
+}
+
+  #define CLOCK_BURST_BEGIN() clock_burst_begin()
+  #define CLOCK_BURST_END() clock_burst_end()
+#else
+  #define CLOCK_BURST_BEGIN()
+  #define CLOCK_BURST_END()
+#endif
 
 //////////////////////////////////////////////////////////////////////////
 // Voltage measurement
@@ -124,166 +614,862 @@ long cellvoltage = 3200;
 #define ADMUX_VCCWRT1V1 (_BV(MUX5) | _BV(MUX0))
 #elif defined (__AVR_ATtiny25__) || defined(__AVR_ATtiny45__) || defined(__AVR_ATtiny85__)
 #define ADMUX_VCCWRT1V1 (_BV(MUX3) | _BV(MUX2))
+// temperature sensor (ADC4) against the internal 1.1V reference
+#define ADMUX_TEMPERATURE (_BV(REFS1) | _BV(MUX3) | _BV(MUX2) | _BV(MUX1) | _BV(MUX0))
 #else
 #define ADMUX_VCCWRT1V1 (_BV(REFS0) | _BV(MUX3) | _BV(MUX2) | _BV(MUX1))
 #endif  
 
-long readADC() {
-  // Read 1.1V reference against AVcc
-  // set the reference to Vcc and the measurement to the internal 1.1V reference
-  if (ADMUX != ADMUX_VCCWRT1V1)
-  {
-    ADMUX = ADMUX_VCCWRT1V1;
+// ADC clock prescaler, ADC clock should be 50 - 200 kHz
+#if F_CPU <= 1600000L
+#define ADC_PRESCALER      8
+#define ADC_PRESCALER_BITS (_BV(ADPS1) | _BV(ADPS0))
+#elif F_CPU <= 3200000L
+#define ADC_PRESCALER      16
+#define ADC_PRESCALER_BITS _BV(ADPS2)
+#elif F_CPU <= 6400000L
+#define ADC_PRESCALER      32
+#define ADC_PRESCALER_BITS (_BV(ADPS2) | _BV(ADPS0))
+#else
+#define ADC_PRESCALER      64
+#define ADC_PRESCALER_BITS (_BV(ADPS2) | _BV(ADPS1))
+#endif
 
-    // Bandgap reference start-up time: max 70us
-    // Wait for Vref to settle.
-    delayMicroseconds(350); 
-  }
+// duration of a single conversion (13 ADC clocks) and of the first conversion
+// after enabling the ADC (25 ADC clocks) in us
+const unsigned long c_AdcConversionTime = (13UL * ADC_PRESCALER * 1000000UL) / F_CPU;
+const unsigned long c_AdcFirstConversionTime = (25UL * ADC_PRESCALER * 1000000UL) / F_CPU;
+
+// number of extra bits: largest n (n <= 3) with 4^n conversions fitting into the budget
+constexpr byte adc_oversampling_bits(byte bits) {
+  return ((bits < 3) && ((1UL << (2 * (bits + 1))) * c_AdcConversionTime <= c_AdcBurstBudget))
+    ? adc_oversampling_bits(bits + 1) : bits;
+}
+
+const byte c_AdcOversamplingBits = adc_oversampling_bits(0);
+// number of conversions per burst
+const byte c_AdcBurstSize = 1 << (2 * c_AdcOversamplingBits);
+
+// Settle time (in us) before the first measurement: bandgap reference start-up 
+// (max 70 us) and supply voltage after switching off the loads (200 us)
+const unsigned long c_AdcSettleTime = 200;
+// the first conversion after enabling the ADC takes 25 ADC clocks, add
+// regular conversions until the settle time has passed
+const byte c_AdcSettleConversions = 1 +
+  ((c_AdcFirstConversionTime >= c_AdcSettleTime) ? 0 :
+    (c_AdcSettleTime - c_AdcFirstConversionTime + c_AdcConversionTime - 1) / c_AdcConversionTime);
+
+#ifdef PROFILE
+// length of one Timer1 tick (profiling) in us
+#define PROFILE_TICK_US (64000000UL / F_CPU)
+
+// Timer1 (profiling) stops in ADC noise reduction mode, the conversions are
+// accounted with their conversion time: Timer1 ticks and the remainder (in us)
+unsigned long profile_adc_ticks = 0;
+unsigned int profile_adc_us = 0;
+// the next conversion is the first one after enabling the ADC
+bool profile_adc_first = false;
+#endif
+
+// ADC conversion complete interrupt (wakes up the CPU from ADC noise reduction mode)
+ISR (ADC_vect) {
+}
+
+// enable the ADC for a Vcc measurement (the bandgap against AVcc)
+void adc_enable() {
+  ADMUX = ADMUX_VCCWRT1V1;
+  power_adc_enable();
+  ADCSRA = _BV(ADEN) | ADC_PRESCALER_BITS;
+#ifdef PROFILE
+  profile_adc_first = true;
+#endif
+}
 
-  ADCSRA |= _BV(ADSC); // Start conversion
-  while (bit_is_set(ADCSRA,ADSC)) {}; // measuring
+// perform a single conversion in ADC noise reduction mode
+unsigned int adc_convert() {
+  // Entering ADC noise reduction mode starts the conversion, the CPU sleeps
+  // until the ADC conversion complete interrupt wakes it up again
+  ADCSRA |= _BV(ADIE);
+  set_sleep_mode(SLEEP_MODE_ADC);
+  do {
+#ifdef CELL_BUS
+    // Timer1 stops in ADC noise reduction mode, convert in idle mode during a bus read
+    if (bus_busy()) {
+      set_sleep_mode(SLEEP_MODE_IDLE);
+      ADCSRA |= _BV(ADSC);
+    }
+#endif
+    noInterrupts();    // disable interrupts to assure deterministic execution
+    sleep_enable();
+    interrupts();      // enable interrupts
+    sleep_cpu();       // go to sleep, start conversion
+    // ZZZZZZ....
+    sleep_disable();   // wake up
+  } while (bit_is_set(ADCSRA,ADSC)); // woken up by some other interrupt, conversion still running
+  ADCSRA &= ~_BV(ADIE);
+#ifdef PROFILE
+  profile_adc_us += profile_adc_first ? c_AdcFirstConversionTime : c_AdcConversionTime;
+  while (profile_adc_us >= PROFILE_TICK_US) {
+    profile_adc_us -= PROFILE_TICK_US;
+    profile_adc_ticks++;
+  }
+  profile_adc_first = false;
+#endif
 
   uint8_t low  = ADCL; // must read ADCL first - it then locks ADCH  
   uint8_t high = ADCH; // unlocks both
 
-  long result = (high << 8) | low;
+  unsigned int result = (high << 8) | low;
   return(result);
 }
 
-// calculate Vcc voltage using the given calibration factor
+#ifdef TEMPERATURE
+// ADC channel scheduling: Vcc is measured every cycle, the temperature is
+// sampled rarely and always at the end of a Vcc measurement. The bandgap
+// (measured as Vcc input, then used as reference) is already running and the
+// supply has settled, so the reference switch costs a single discarded
+// conversion instead of a full settle phase.
+
+// number of temperature conversions averaged (the 1 LSB/°C resolution needs
+// no oversampling)
+const byte c_TemperatureConversions = 4;
+
+// time (in s) until the next temperature sample, counted down by the main loop
+unsigned int temperature_countdown = 0;
+// last temperature sensor reading (averaged ADC value) and chip temperature (°C)
+unsigned int temperature_adc = 0;
+int temperature = 0;
+// shunting inhibited due to high chip temperature
+bool temperature_hot = false;
+
+// sample the temperature sensor, the ADC must be enabled
+void temperature_sample() {
+  ADMUX = ADMUX_TEMPERATURE;
+  // first conversion after switching the reference is discarded
+  adc_convert();
+
+  unsigned int sum = 0;
+  for (byte ii = 0; ii < c_TemperatureConversions; ii++) {
+    sum += adc_convert();
+  }
+  temperature_adc = sum / c_TemperatureConversions;
+  temperature = (int) temperature_adc - c_TemperatureOffset;
+
+  if (temperature >= c_ShuntMaxTemperature)
+    temperature_hot = true;
+  else if (temperature < c_ShuntMaxTemperature - c_TemperatureHysteresis)
+    temperature_hot = false;
+}
+
+// advance the temperature sampling schedule by elapsed seconds
+void temperature_age(byte elapsed) {
+  temperature_countdown = (temperature_countdown > elapsed) ? temperature_countdown - elapsed : 0;
+}
+#endif
+
+// returns the oversampled ADC value with c_AdcOversamplingBits extra bits
+// (full scale is 1024 << c_AdcOversamplingBits)
+// The ADC is only enabled during the measurement, call with the loads switched off.
+// With TEMPERATURE the temperature is sampled afterwards if it is due.
+unsigned int readADC() {
+  // Read 1.1V reference against AVcc
+  // set the reference to Vcc and the measurement to the internal 1.1V reference
+  adc_enable();
+
+  // Bandgap reference and supply voltage settle while the CPU sleeps in 
+  // noise reduction mode during the (discarded) first conversions
+  for (byte ii = 0; ii < c_AdcSettleConversions; ii++) {
+    adc_convert();
+  }
+
+  // accumulate burst (at most 64 * 1023, fits 16 bits) and decimate,
+  // relies on the ADC noise (>= 1 LSB) for dithering
+  unsigned int sum = 0;
+  for (byte ii = 0; ii < c_AdcBurstSize; ii++) {
+    sum += adc_convert();
+  }
+
+#ifdef TEMPERATURE
+  if (temperature_countdown == 0) {
+    temperature_sample();
+    temperature_countdown = c_TemperatureInterval;
+  }
+#endif
+
+  // disable ADC, shut down ADC clock
+  ADCSRA &= ~_BV(ADEN);
+  power_adc_disable();
+
+  return(sum >> c_AdcOversamplingBits);
+}
+
+// calculate Vcc voltage from an (oversampled) ADC value using the given calibration factor
 // returns (calibrated) voltage in mV
-long readVcc(long calibration_factor) {
-  // Calculate Vcc (in mV)  
-  return(calibration_factor / readADC());
+unsigned int adc_to_vcc(unsigned long calibration_factor, unsigned int adc_value) {
+  return((calibration_factor << c_AdcOversamplingBits) / adc_value);
 }
 
-long avg_buffer[c_MovingAverageWindow];
-byte avg_index = 0;
+#ifdef SELF_CALIBRATION
+// calibration record, stored at the end of the EEPROM
+struct calibration_record {
+  byte magic;
+  unsigned long factor;
+  byte crc;              // CRC8 of magic and factor
+};
+
+const byte c_CalibrationMagic = 0xc5;
+const unsigned int c_CalibrationAddr = E2END + 1 - sizeof(calibration_record);
+
+// calibration factor in use (from the EEPROM or calibration_factor_custom)
+unsigned long calibration_factor = calibration_factor_custom;
+bool calibration_stored = false;
+
+byte calibration_crc(const calibration_record &r) {
+  const byte *p = (const byte *) &r;
+  byte crc = 0;
+  for (byte ii = 0; ii < sizeof(r) - 1; ii++)
+    crc = _crc_ibutton_update(crc, p[ii]);
+  return crc;
+}
+
+// load the calibration factor from the EEPROM, returns false if there is no
+// valid calibration record
+bool calibration_load() {
+  calibration_record r;
+  eeprom_read_block(&r, (const void *) c_CalibrationAddr, sizeof(r));
+  if ((r.magic != c_CalibrationMagic) || (r.crc != calibration_crc(r)))
+    return false;
+
+  calibration_factor = r.factor;
+  calibration_stored = true;
+  return true;
+}
 
-// calculate moving average
-long moving_average(long val) {
-  avg_buffer[avg_index++] = val;
-  avg_index = avg_index % c_MovingAverageWindow;
+void calibration_store(unsigned long factor) {
+  calibration_record r;
+  r.magic = c_CalibrationMagic;
+  r.factor = factor;
+  r.crc = calibration_crc(r);
+  eeprom_update_block(&r, (void *) c_CalibrationAddr, sizeof(r));
 
-  long sum = 0;
-  for (byte ii = 0; ii < c_MovingAverageWindow; ii++) {
-    sum += avg_buffer[ii];
+  calibration_factor = factor;
+  calibration_stored = true;
+}
+
+// calculate Vcc voltage from an (oversampled) ADC value using the calibration
+// factor of this module
+unsigned int adc_to_vcc_custom(unsigned int adc_value) {
+  return(adc_to_vcc(calibration_factor, adc_value));
+}
+
+// no lookup table, adc_to_vcc_custom() always divides
+inline bool vcc_table_covers(unsigned int) {
+  return false;
+}
+#else
+// Vcc lookup table for the custom calibration factor
+// Covers the operating voltage range c_VccTableMin - c_VccTableMax, each entry
+// holds the result of adc_to_vcc(calibration_factor_custom, adc_value) for one
+// 10 bit ADC value, the extra bits of an oversampled value are interpolated
+// between two entries. The table is generated at compile time and stored in
+// PROGMEM.
+const unsigned int c_VccTableMin = 2600;
+const unsigned int c_VccTableMax = 3800;
+// flash (in bytes) the table may use on the smallest target (ATtiny45)
+const unsigned int c_VccTableBudget = 320;
+
+// 10 bit ADC value range covered by the table (high voltage -> low ADC value)
+const unsigned int c_VccTableAdcMin = calibration_factor_custom / c_VccTableMax;
+const unsigned int c_VccTableAdcMax = calibration_factor_custom / c_VccTableMin;
+
+template <unsigned int... I> struct index_list {};
+template <unsigned int N, unsigned int... I> struct make_index_list : make_index_list<N - 1, N - 1, I...> {};
+template <unsigned int... I> struct make_index_list<0, I...> { typedef index_list<I...> type; };
+
+template <class T> struct vcc_table_gen;
+template <unsigned int... I> struct vcc_table_gen<index_list<I...> > {
+  static const uint16_t table[sizeof...(I)];
+};
+template <unsigned int... I>
+const uint16_t vcc_table_gen<index_list<I...> >::table[sizeof...(I)] PROGMEM = {
+  (uint16_t) (calibration_factor_custom / (c_VccTableAdcMin + I))... };
+
+// one entry beyond c_VccTableAdcMax as upper end of the interpolation
+typedef vcc_table_gen<make_index_list<c_VccTableAdcMax - c_VccTableAdcMin + 2>::type> vcc_table;
+static_assert(sizeof(vcc_table::table) <= c_VccTableBudget, "Vcc table too large, narrow c_VccTableMin - c_VccTableMax");
+
+// dividend of adc_to_vcc() for the custom calibration factor
+const unsigned long c_VccDividend = calibration_factor_custom << c_AdcOversamplingBits;
+
+// returns true if the (oversampled) ADC value is within the lookup table
+inline bool vcc_table_covers(unsigned int adc_value) {
+  const unsigned int code = adc_value >> c_AdcOversamplingBits;
+  return (code >= c_VccTableAdcMin) && (code <= c_VccTableAdcMax);
+}
+
+// calculate Vcc voltage from an (oversampled) ADC value using the custom calibration factor
+// same result as adc_to_vcc(calibration_factor_custom, adc_value), but uses the
+// lookup table instead of a 32 bit division within the operating voltage range:
+// the interpolation is within 1 mV of the quotient, one multiplication
+// corrects it to the exact result
+unsigned int adc_to_vcc_custom(unsigned int adc_value) {
+  if (vcc_table_covers(adc_value)) {
+    const unsigned int code = adc_value >> c_AdcOversamplingBits;
+    const uint16_t *entry = &vcc_table::table[code - c_VccTableAdcMin];
+    const unsigned int high = pgm_read_word(entry);
+    const unsigned int low = pgm_read_word(entry + 1);
+    const byte fraction = adc_value & ((1 << c_AdcOversamplingBits) - 1);
+    unsigned int vcc = high - (((high - low) * fraction) >> c_AdcOversamplingBits);
+    if ((unsigned long) vcc * adc_value > c_VccDividend)
+      vcc--;
+    else if ((unsigned long) (vcc + 1) * adc_value <= c_VccDividend)
+      vcc++;
+    return(vcc);
   }
-  return sum / c_MovingAverageWindow;
+
+  return(adc_to_vcc(calibration_factor_custom, adc_value));
+}
+#endif
+
+// measure Vcc voltage using the custom calibration factor
+// returns (calibrated) voltage in mV
+unsigned int readVcc() {
+  unsigned int adc_value = readADC();
+  // Calculate Vcc (in mV), the table lookup costs less than switching the
+  // clock, only the 32 bit division runs in a burst
+  if (vcc_table_covers(adc_value))
+    return(adc_to_vcc_custom(adc_value));
+  CLOCK_BURST_BEGIN();
+  unsigned int vcc = adc_to_vcc_custom(adc_value);
+  CLOCK_BURST_END();
+  return(vcc);
 }
 
+// highest sample value passed to moving_average(): Vcc in mV, limited by
+// the absolute maximum supply voltage of the ATtiny, or the oversampled
+// ADC value in CALIBRATION_MODE
+const unsigned int c_MovingAverageMaxSample =
+  (1024U << c_AdcOversamplingBits) > 6000 ? (1024U << c_AdcOversamplingBits) : 6000;
+
+// moving average of the measured cell voltage
+moving_average_t<c_MovingAverageWindow, c_MovingAverageMaxSample> avg;
+
 //////////////////////////////////////////////////////////////////////////
 // Business logic
 //////////////////////////////////////////////////////////////////////////
 
 //////////////////////////////////////////////////////////////////////////
 // Cell state calculation
+// (see cellstate.h for the cell state engine)
 
-// Possible cell states
-enum { 
-  e_CellInvalid = 0, 
-  e_CellNorm, 
-  e_CellLVC, 
-  e_CellHVC, 
-  e_TOTALCELLSTATES };
+// distance (in mV) between cell voltage and the given threshold
+unsigned int threshold_distance(int threshold) {
+  return (cell.cellvoltage > (unsigned int) threshold) ? cell.cellvoltage - threshold : threshold - cell.cellvoltage;
+}
 
-#ifdef DEBUG
-const char CellStateDescription[e_TOTALCELLSTATES][6] = { 
-  "n/a", 
-  "OK", 
-  "LVC", 
-  "HVC" };
+// determine the length of the next measurement cycle in normal state
+// returns the watchdog timeout
+byte adaptive_period() {
+  static const byte timeouts[] = {
+    WD_TIMEOUT_1000ms, WD_TIMEOUT_2000ms, WD_TIMEOUT_4000ms, WD_TIMEOUT_8000ms };
+
+  unsigned int distance = threshold_distance(c_LVoltage_engage);
+  unsigned int d = threshold_distance(c_ShuntVoltage_engage);
+  if (d < distance)
+    distance = d;
+  d = threshold_distance(c_HVoltage_engage);
+  if (d < distance)
+    distance = d;
+
+  byte step = 0;
+  // measure every second while a state change is pending and within the fast
+  // trip margin of the LVC/HVC thresholds (a fast trip is caught at the next
+  // measurement)
+  if ((cell.cellstate_pending == cell.cellstate) && (cell.shunting_pending == cell.shunting) &&
+      (threshold_distance(c_LVoltage_engage) >= c_FastTripMargin) &&
+      (threshold_distance(c_HVoltage_engage) >= c_FastTripMargin)) {
+    while ((step < 3) && (distance >= c_AdaptivePeriodStep)) {
+      distance -= c_AdaptivePeriodStep;
+      step++;
+    }
+  }
+  return timeouts[step];
+}
+
+//////////////////////////////////////////////////////////////////////////
+// Power management
+// All peripherals are shut down via the Power Reduction Register unless in
+// use (ADC: readADC(), Timer0: output scheduler), the analog comparator and
+// all digital input buffers are disabled, unused pins are driven low.
+//
+// Per state policy and typical MCU supply current targets at 3.3 V (datasheet
+// figures: active 1 MHz ~0.5 mA, idle 1 MHz ~0.15 mA, power down with WDT 
+// ~4 uA, BOD ~20 uA; LED, shunt and loop relay currents not included):
+//
+// State     Sleep                           BOD in sleep     Target
+// LVC       power down 1 s                  off (*)          ~5 uA
+// normal    idle 20 ms, power down 1 - 8 s  off              ~8 uA (1 s) - ~5 uA (8 s)
+// shunting  power down 1 s, idle 100 ms     off              ~20 uA
+//           (SHUNT_PWM: idle 1.1 s)         n/a              ~150 uA
+// HVC       idle 1.1 s                      n/a              ~150 uA
+// invalid   idle 1 s                        n/a              ~150 uA
+//
+// (*) BOD is kept enabled in power down if the cell voltage is below
+//     c_BodSleepMinVoltage, a deeply discharged cell may approach the BOD level.
+//     BOD can only be disabled in power down, idle always keeps it active.
+
+// minimum cell voltage (mV) for disabling BOD during power down
+const unsigned int c_BodSleepMinVoltage = 2500;
+
+// disable BOD during power down
+bool sleep_bod_off = false;
+
+void power_init() {
+  // all pins are outputs (driven low by default), disable digital input buffers
+  DIDR0 = _BV(ADC0D) | _BV(ADC1D) | _BV(ADC2D) | _BV(ADC3D) | _BV(AIN0D) | _BV(AIN1D);
+
+  // disable analog comparator
+  ACSR |= _BV(ACD);
+
+  // disable ADC (may have been enabled by the Arduino core), shut down unused peripherals
+  ADCSRA &= ~_BV(ADEN);
+  power_adc_disable();
+  power_timer0_disable();
+  power_timer1_disable();
+  power_usi_disable();
+}
+
+// apply power policy for the current cell state
+void power_policy() {
+  // cell voltage is not known before a valid state has been determined
+  sleep_bod_off = (cell.cellstate != e_CellInvalid) && (cell.cellvoltage >= c_BodSleepMinVoltage);
+#ifdef CLOCK_BURST
+  clock_burst_ok = (cell.cellstate != e_CellInvalid) && (cell.cellvoltage >= c_ClockBurstMinVoltage);
 #endif
+}
+
+//////////////////////////////////////////////////////////////////////////
+// Profiling
+// Awake time is counted by Timer1 (CK/64). The timer advances while the CPU
+// is active or in idle mode, it stops in ADC noise reduction mode (clkI/O
+// halted) and in power down mode. Conversions in ADC noise reduction mode are
+// added from their conversion time (adc_convert()), power down time is
+// accounted with the nominal watchdog timeout. All counters accumulate since
+// startup.
+
+#ifdef PROFILE
+struct profile_counters {
+  unsigned long awake;    // Timer1 ticks
+  unsigned long sleep;    // ms in power down mode
+  unsigned int wakeups;   // watchdog wakeups from power down
+};
+
+struct profile_data {
+  // awake ticks of the last measurement cycle
+  unsigned int cycle;
+  // ticks spent in readADC() and determine_cellstate()
+  unsigned long adc;
+  unsigned long cellstate;
+  // counters per cell state (state of the loop() branch)
+  profile_counters state[e_TOTALCELLSTATES];
+};
+
+profile_data profile;
+
+// Timer1 overflows (upper bits of the tick counter)
+volatile unsigned int profile_overflows = 0;
+// start of the current measurement cycle
+unsigned long profile_mark = 0;
+
+ISR (TIMER1_OVF_vect) {
+  profile_overflows++;
+}
+
+void profile_init() {
+  power_timer1_enable();
+  TCNT1 = 0;
+  TIFR = _BV(TOV1);
+  TIMSK |= _BV(TOIE1);
+  TCCR1 = _BV(CS12) | _BV(CS11) | _BV(CS10);  // CK/64
+}
+
+// current tick count
+unsigned long profile_now() {
+  byte sreg = SREG;
+  noInterrupts();
+  byte low = TCNT1;
+  unsigned int high = profile_overflows;
+  // overflow not yet handled by the interrupt
+  if ((TIFR & _BV(TOV1)) && (low < 255))
+    high++;
+  unsigned long adc = profile_adc_ticks;
+  SREG = sreg;
+  return (((unsigned long) high << 8) | low) + adc;
+}
+
+// account power down sleep with the given watchdog timeout
+void profile_sleep(byte duration) {
+  profile.state[cell.cellstate].sleep += 16UL << wdt_prescaler(duration);
+  profile.state[cell.cellstate].wakeups++;
+}
+
+// account the awake time since the start of the current measurement cycle
+void profile_cycle_end() {
+  unsigned long ticks = profile_now() - profile_mark;
+  profile.state[cell.cellstate].awake += ticks;
+  profile.cycle = (ticks > 0xffff) ? 0xffff : ticks;
+}
 
-// Current cell state
-byte cellstate = e_CellInvalid;
+  #define PROFILE_START(t) unsigned long t = profile_now()
+  #define PROFILE_STOP(t, counter) (counter) += profile_now() - (t)
+#else
+  #define PROFILE_START(t)
+  #define PROFILE_STOP(t, counter)
+#endif
 
-// Tentative new cell state
-byte cellstate_pending = e_CellInvalid;
+#ifdef EVENT_LOG
+//////////////////////////////////////////////////////////////////////////
+// Event log
+// Ring of records in EEPROM. Each record holds the event (boot, new cell
+// state or new extremes), the uptime and averaged cell voltage at the event
+// and the min/max averaged cell voltage so far, the extremes are carried
+// over from the newest record at boot. The records are written round robin
+// (wear leveling) and only on a cell state transition or every
+// c_LogInterval seconds if the extremes have changed. The EEPROM ready
+// interrupt writes one byte after the other (~3.4 ms each, unchanged bytes
+// are skipped) while the CPU sleeps in idle mode. With STATISTICS the
+// statistics block (end of the EEPROM) is written the same way.
+
+// event types, a cell state transition is logged with the new cell state
+enum {
+  e_LogBoot = e_CellInvalid,
+  e_LogExtremes = e_TOTALCELLSTATES,
+  e_LogEmpty = 0xff };     // erased EEPROM
+
+struct log_record {
+  byte seq;                // sequence number (wraps around)
+  byte type;
+  unsigned int cellvoltage;  // averaged cell voltage at the event (mV)
+  unsigned int min_voltage;  // lowest averaged cell voltage (mV)
+  unsigned int max_voltage;  // highest averaged cell voltage (mV)
+  unsigned long uptime;    // time since boot (s)
+};
+
+// end of the EEPROM area available for the log (before the calibration record)
+#ifdef SELF_CALIBRATION
+const unsigned int c_LogEnd = c_CalibrationAddr;
+#else
+const unsigned int c_LogEnd = E2END + 1;
+#endif
 
-// cycle age of the pending new state
-unsigned int cellstate_pending_age = 0;
+#ifdef STATISTICS
+// Statistics
+// Accumulated time (in units of 2^scale s) per voltage band, per cell state
+// and with the shunt on, and the number of LVC/HVC entries. The 16 bit
+// counters are updated in constant time once per cycle, when a counter would
+// saturate all counters are halved and scale is incremented (the statistics
+// keep their proportions and age exponentially).
+struct statistics {
+  byte scale;                            // number of halvings
+  unsigned int lvc;                      // LVC entries
+  unsigned int hvc;                      // HVC entries
+  unsigned int shunting;                 // shunt on time
+  unsigned int state[e_TOTALCELLSTATES]; // time per cell state
+  unsigned int band[c_StatisticsBands];  // time per voltage band
+};
+
+statistics stats;
+
+// statistics block: marker byte followed by the statistics
+const byte c_StatisticsMagic = 0x5a;
+const unsigned int c_StatisticsAddr = c_LogEnd - 1 - sizeof(statistics);
+
+// the log uses the whole EEPROM except for the statistics and calibration record
+const byte c_LogRecords = c_StatisticsAddr / sizeof(log_record);
+#else
+// the log uses the whole EEPROM except for the calibration record
+const byte c_LogRecords = c_LogEnd / sizeof(log_record);
+#endif
+// records span less than half the sequence number range
+static_assert(c_LogRecords < 128, "too many log records for 8 bit sequence numbers");
+
+// record being written, also holds the sequence number of the newest record
+log_record log_pending;
+// EEPROM address of the block being written, slot of the next record
+unsigned int log_addr;
+byte log_slot = 0;
+// block being written (log_pending or the statistics), its size and the next
+// byte to write (log_write_size: idle)
+const byte *log_src;
+byte log_write_size = 0;
+volatile byte log_write_pos = 0;
+
+// extremes since the last record
+unsigned int log_min = 0xffff;
+unsigned int log_max = 0;
+bool log_extremes_changed = false;
+
+// time since boot (s) and of the last record
+unsigned long uptime = 0;
+unsigned long log_last_write = 0;
+
+// EEPROM ready interrupt: write the next changed byte of the pending record
+ISR (EE_RDY_vect) {
+  while (log_write_pos < log_write_size) {
+    EEAR = log_addr + log_write_pos;
+    byte val = log_src[log_write_pos++];
+    EECR |= _BV(EERE);
+    if (EEDR != val) {
+      EEDR = val;
+      EECR = _BV(EERIE) | _BV(EEMPE);  // atomic erase and write
+      EECR |= _BV(EEPE);
+      return;
+    }
+  }
+  // block complete
+  EECR = 0;
+}
 
-// shunting state
-bool shunting = false;
-bool shunting_pending = false;
-// cycle age of the pending new shunting state
-unsigned int shunting_pending_age = 0;
+inline bool log_busy() {
+  return log_write_pos < log_write_size;
+}
 
-void determine_cellstate() {
-  // use previous state as default
-  byte cellstate_new = cellstate;
-  bool shunting_new = shunting;
+// sleep in idle mode until the pending record is written
+void log_wait() {
+  set_sleep_mode(SLEEP_MODE_IDLE);
+  noInterrupts();
+  while (log_busy()) {
+    sleep_enable();
+    interrupts();
+    sleep_cpu();
+    sleep_disable();
+    noInterrupts();
+  }
+  interrupts();
+}
 
-  // determine new shunting state
-  // start shunting
-  if (!shunting && (cellvoltage > c_ShuntVoltage_engage)) {
-    shunting_new = true;
+// find the newest record and continue the ring and the extremes from there
+void log_init() {
+  log_record r;
+  bool found = false;
+
+  for (byte ii = 0; ii < c_LogRecords; ii++) {
+    eeprom_read_block(&r, (const void *) (ii * sizeof(log_record)), sizeof(r));
+    if (r.type == e_LogEmpty)
+      continue;
+    // newer: sequence number ahead of the newest so far
+    if (!found || (byte) (r.seq - log_pending.seq - 1) < 0x7f) {
+      found = true;
+      log_pending = r;
+      log_slot = ii + 1;
+    }
   }
-  // stop shunting
-  if (shunting && (cellvoltage < c_ShuntVoltage_disengage)) {
-    shunting_new = false;
+  if (log_slot >= c_LogRecords)
+    log_slot = 0;
+  if (found) {
+    log_min = log_pending.min_voltage;
+    log_max = log_pending.max_voltage;
+  } else {
+    log_pending.seq = 0xff;
   }
+}
 
-  // determine new cell state
-  // coming from a HVC we need to get below the lower HVC threshold to leave the HVC state
-  if ((cellstate == e_CellHVC) && (cellvoltage < c_HVoltage_disengage))
-    cellstate_new = e_CellNorm;
+// start writing a block to log_addr, the EEPROM must be idle (log_wait())
+void log_write_block(const void *src, byte size) {
+  log_src = (const byte *) src;
+  log_write_size = size;
+  log_write_pos = 0;
+  EECR = _BV(EERIE);  // the EEPROM ready interrupt writes the block
+}
+
+// start writing a new record for the given event
+void log_write(byte type) {
+  log_wait();
 
-  // coming from a LVC reset this condition when passing the upper LVC threshold
-  if ((cellstate == e_CellLVC) && (cellvoltage > c_LVoltage_disengage))
-    cellstate_new = e_CellNorm;
+  log_pending.seq++;
+  log_pending.type = type;
+  log_pending.cellvoltage = cell.cellvoltage;
+  log_pending.min_voltage = log_min;
+  log_pending.max_voltage = log_max;
+  log_pending.uptime = uptime;
 
-  // special case: after bootup the cell state is invalid, make sure we leave that state
-  if ((cellstate == e_CellInvalid) && (cellvoltage > c_LVoltage_engage) && (cellvoltage < c_HVoltage_engage))
-    cellstate_new = e_CellNorm;
+  log_addr = log_slot * sizeof(log_record);
+  if (++log_slot >= c_LogRecords)
+    log_slot = 0;
+  log_last_write = uptime;
+  log_extremes_changed = false;
 
-  if ((cellvoltage > c_LVoltage_disengage) && (cellvoltage < c_HVoltage_disengage))
-    cellstate_new = e_CellNorm; // final decision
+  log_write_block(&log_pending, sizeof(log_pending));
+}
 
-  if (cellvoltage >= c_HVoltage_engage)
-    cellstate_new = e_CellHVC; // final decision
+// track the extremes of the averaged cell voltage
+void log_extremes() {
+  if (cell.cellvoltage < log_min) {
+    log_min = cell.cellvoltage;
+    log_extremes_changed = true;
+  }
+  if (cell.cellvoltage > log_max) {
+    log_max = cell.cellvoltage;
+    log_extremes_changed = true;
+  }
+}
 
-  if (cellvoltage <= c_LVoltage_engage)
-    cellstate_new = e_CellLVC; // final decision
+// track the extremes and log a cell state transition, called once per
+// measurement cycle with the cell state before determine_cellstate()
+void log_update(byte prev_state, byte elapsed) {
+  uptime += elapsed;
+  log_extremes();
 
+  if (cell.cellstate != prev_state)
+    log_write(cell.cellstate);
+  else if (log_extremes_changed && (uptime - log_last_write >= c_LogInterval))
+    log_write(e_LogExtremes);
+}
 
-  if (shunting_pending != shunting_new) {
-    shunting_pending = shunting_new;
-    shunting_pending_age = 0;    
+#ifdef STATISTICS
+// uptime of the last statistics store, store pending, report the
+// statistics via telemetry
+unsigned long stats_last_store = 0;
+bool stats_dirty = false;
+bool stats_report = true;
+
+// load the statistics from the EEPROM, an EEPROM without statistics block is
+// initialized (once, the CPU waits for the EEPROM)
+void stats_init() {
+  log_wait();
+  if (eeprom_read_byte((const byte *) c_StatisticsAddr) == c_StatisticsMagic) {
+    eeprom_read_block(&stats, (const void *) (c_StatisticsAddr + 1), sizeof(stats));
   } else {
-    if (shunting_pending_age > c_StateSettleTime) {
-      shunting = shunting_new;
-    } else {
-      shunting_pending_age++;
-    }
+    eeprom_update_block(&stats, (void *) (c_StatisticsAddr + 1), sizeof(stats));
+    eeprom_update_byte((byte *) c_StatisticsAddr, c_StatisticsMagic);
   }
+}
 
+// store the statistics, the EEPROM must be idle. The counters are written
+// directly (they only change once per cycle, a block is written in less
+// than 200 ms).
+void stats_store() {
+  log_addr = c_StatisticsAddr + 1;
+  log_write_block(&stats, sizeof(stats));
+  stats_last_store = uptime;
+  stats_dirty = false;
+  stats_report = true;
+}
 
-  if (cellstate_new == e_CellInvalid) // should not happen
-    return;
+// halve all counters (the counters follow scale)
+void stats_halve() {
+  unsigned int *c = &stats.lvc;
+  for (byte ii = 0; ii < (sizeof(stats) - 1) / sizeof(unsigned int); ii++)
+    c[ii] >>= 1;
+  stats.scale++;
+}
 
-  if (cellstate_pending != cellstate_new) {
-    cellstate_pending = cellstate_new;
-    cellstate_pending_age = 0;    
-  } else {
-    if (cellstate_pending_age > c_StateSettleTime) {
-      cellstate = cellstate_new;
-    } else {
-      cellstate_pending_age++;
-    }
+inline void stats_add(unsigned int &counter, byte value) {
+  if (counter > 0xffffU - value)
+    stats_halve();
+  counter += value;
+}
+
+// account the cycle (elapsed s) with the new cell state, called once per
+// measurement cycle after log_update()
+void stats_update(byte prev_state, byte elapsed) {
+  byte band = 0;
+  if (cell.cellvoltage >= c_StatisticsMin) {
+    unsigned int b = (cell.cellvoltage - c_StatisticsMin) >> c_StatisticsBandShift;
+    band = (b < c_StatisticsBands) ? b : c_StatisticsBands - 1;
   }
+  stats_add(stats.band[band], elapsed);
+  stats_add(stats.state[cell.cellstate], elapsed);
+  if (cell.shunting)
+    stats_add(stats.shunting, elapsed);
+  if (cell.cellstate != prev_state) {
+    if (cell.cellstate == e_CellLVC)
+      stats_add(stats.lvc, 1);
+    else if (cell.cellstate == e_CellHVC)
+      stats_add(stats.hvc, 1);
+  }
+
+  // store after a log record (once the record is written) or every c_LogInterval
+  if ((log_last_write == uptime) || (uptime - stats_last_store >= c_LogInterval))
+    stats_dirty = true;
+  if (stats_dirty && !log_busy())
+    stats_store();
 }
+#endif
+#endif
 
-// cycle age of last HVC or LVC event
-unsigned int last_cutoff_age = 0;
-// special value indicating that no cutoff has happened recently
-const unsigned int c_NoCutoffEvent = 0xffff;
+#if defined(CELL_BUS) || defined(EVENT_LOG)
+// a bus read needs Timer1 and an EEPROM write keeps the oscillator running,
+// sleep in idle mode instead of power down meanwhile
+inline bool deep_sleep_idle() {
+  return
+#ifdef CELL_BUS
+    bus_busy() ||
+#endif
+#ifdef EVENT_LOG
+    log_busy() ||
+#endif
+    false;
+}
+#endif
 
 //////////////////////////////////////////////////////////////////////////
+// Time base
+// Milliseconds since startup, advanced by every sleep period: idle steps with
+// the Timer0 ticks, power down with the watchdog timeout. The watchdog
+// oscillator drifts by up to +-10 % with voltage and temperature, its period
+// is measured against the system clock at boot and every
+// c_WdtCalibrationInterval (wdt_calibrate()). The awake time (a few ms per
+// measurement cycle) is not accounted.
+
+// length (in us) of a Timer0 tick at CK/1024 (scheduler, watchdog calibration)
+#define TIME_TICK_US (1024UL * 1000000UL / F_CPU)
+// nominal length of the 250 ms watchdog timeout (32K cycles at 128 kHz) in ticks
+const unsigned int c_WdtNominalTicks = 256000UL / TIME_TICK_US;
+
+// ms since startup (wraps after 49 days) and the fraction of the current ms (in us)
+unsigned long time_ms = 0;
+unsigned int time_us = 0;
+// time_ms at the previous time_elapsed() call (start of the whole second)
+unsigned long time_last = 0;
+// measured length of the 250 ms watchdog timeout in ticks and time_ms at the
+// last measurement
+unsigned int wdt_ticks = c_WdtNominalTicks;
+unsigned long wdt_calibrated = 0;
+
+// advance the time base by the specified number of Timer0 ticks
+void time_advance(unsigned int ticks) {
+  unsigned long us = (unsigned long) ticks * TIME_TICK_US + time_us;
+  time_ms += us / 1000;
+  time_us = us % 1000;
+}
+
+// calibrated length of the given watchdog timeout in ticks
+unsigned int wdt_timeout_ticks(byte duration) {
+  byte wdp = wdt_prescaler(duration);
+  // wdt_ticks is the length of wdp 4 (250 ms)
+  return ((unsigned long) wdt_ticks << wdp) >> 4;
+}
+
+// whole seconds elapsed since the previous call (at most 255), the remaining
+// fraction is carried over to the next call
+byte time_elapsed() {
+  unsigned long ms = time_ms - time_last;
+  if (ms >= 256000UL) {
+    time_last = time_ms;
+    return 255;
+  }
+  byte elapsed = ms / 1000;
+  time_last += elapsed * 1000UL;
+  return elapsed;
+}
+
+// set by the watchdog interrupt, other interrupts may wake up the CPU earlier
+volatile bool wdt_fired = false;
 
 // Watchdog interrupt (executed when watchdog times out)
 ISR (WDT_vect) {
+  wdt_fired = true;
 }
 
 // Enter deep sleep for the specified duration
@@ -292,238 +1478,1424 @@ void deep_sleep(byte duration) {
   // clear unwanted bits from duration
   duration &= 0b00100111;
 
-  // disable ADC
-  ADCSRA &= ~_BV(ADEN); 
+  // NOTE: ADC is disabled outside of readADC()
 
   // set up watchdog timer
   wdt_reset(); // Reset Watchdog Timer
   MCUSR &= ~_BV(WDRF);                       // clear watchdog Reset Flag
 
   WDTCR = _BV(WDCE) | _BV(WDE);              // watchdog Change Enable, Enable
+  wdt_fired = false;
   WDTCR = _BV(WDIE) | duration; // watchdog Interrupt Enable, set timeout
   
+#ifdef PROFILE_PIN
+  AUX_LOW;
+#endif
   set_sleep_mode(SLEEP_MODE_PWR_DOWN);  
   noInterrupts();      // disable interrupts to assure deterministic execution
-  sleep_enable();
-  sleep_bod_disable(); // disable brown-out detection
-  interrupts();        // enable interrupts
-  sleep_cpu();         // go to sleep
-  // ZZZZZZ....
-  sleep_disable(); // wake up
-
-  // re-enable ADC
-  ADCSRA |= _BV(ADEN);
+  while (!wdt_fired) {
+#if defined(CELL_BUS) || defined(EVENT_LOG)
+    set_sleep_mode(deep_sleep_idle() ? SLEEP_MODE_IDLE : SLEEP_MODE_PWR_DOWN);
+#endif
+    sleep_enable();
+    if (sleep_bod_off)
+      sleep_bod_disable(); // disable brown-out detection (power down only)
+    interrupts();        // enable interrupts
+    sleep_cpu();         // go to sleep
+    // ZZZZZZ....
+    sleep_disable(); // wake up
+    noInterrupts();
+  }
+  interrupts();
+#ifdef PROFILE_PIN
+  AUX_HIGH;
+#endif
+  time_advance(wdt_timeout_ticks(duration));
+#ifdef PROFILE
+  profile_sleep(duration);
+#endif
 }
 
-// blinks argument as 4 digit hex number
-// signal 4 bit per digit
-//   1 is encoded as two short flashes
-//   0 is encoded as one short flash
-// digits separated by a longer pause
-void blink_int(unsigned int arg) {
-  // start with a long burst of rapid flashes to indicate start of sequence
-  for (byte ii = 0; ii < 20; ii++) {
-    LED_ON;
-    delay(10);
-    LED_OFF;
-    delay(50);
+// measure the 250 ms watchdog timeout with Timer0 (CK/1024), the CPU sleeps
+// in idle mode meanwhile
+void wdt_calibrate() {
+  power_timer0_enable();
+  TCCR0B = 0;                       // stop timer
+  TCCR0A = 0;                       // normal mode, OC0A/OC0B disconnected
+  set_sleep_mode(SLEEP_MODE_IDLE);
+
+  noInterrupts();
+  wdt_reset();
+  MCUSR &= ~_BV(WDRF);
+  WDTCR = _BV(WDCE) | _BV(WDE);
+  wdt_fired = false;
+  WDTCR = _BV(WDIE) | WD_TIMEOUT_250ms;
+  TCNT0 = 0;
+  TIFR = _BV(TOV0);                 // clear pending overflow
+  TCCR0B = _BV(CS02) | _BV(CS00);   // start timer, CK/1024
+  while (!wdt_fired) {
+    sleep_enable();
+    interrupts();
+    sleep_cpu();
+    // ZZZZZZ....
+    sleep_disable();
+    noInterrupts();
   }
-  deep_sleep(WD_TIMEOUT_1000ms);
+  TCCR0B = 0;                       // stop timer
+  unsigned int ticks = TCNT0;
+  // the timeout is at most ~1.1 * 250 ticks, i. e. one overflow
+  if (TIFR & _BV(TOV0))
+    ticks += 256;
+  interrupts();
+  power_timer0_disable();
+
+  time_advance(ticks);
+  // ignore implausible results (more than 25 % off)
+  if ((ticks > c_WdtNominalTicks - c_WdtNominalTicks / 4) &&
+      (ticks < c_WdtNominalTicks + c_WdtNominalTicks / 4))
+    wdt_ticks = ticks;
+  wdt_calibrated = time_ms;
+}
 
-  // send BCD encoded decimal digits of the supplied argument
-  // maximum number 4 digit BCD can handle
+//////////////////////////////////////////////////////////////////////////
+// Output scheduler
+// The LED, shunt and loop outputs are driven by patterns consisting of a list
+// of steps. Each step holds the outputs for the given duration. Short steps
+// are timed by Timer0, the step edges are applied in the compare match interrupt
+// while the CPU sleeps in idle mode. Long steps matching a watchdog timeout
+// are slept in power down mode using deep_sleep().
+
+// outputs controlled by the scheduler
+#define O_LED   (1 << PIN_LED)
+#define O_SHUNT (1 << PIN_SHUNT)
+#define O_LOOP  (1 << PIN_LOOP)
+#define SCHED_OUTPUTS (O_LED | O_SHUNT | O_LOOP)
+
+// loop output of steps that open the loop for a warning pulse
+#ifdef LOOP_WARNING
+#define O_LOOP_WARN 0
+#else
+#define O_LOOP_WARN O_LOOP
+#endif
 
-  for (char p = 3; p >=0; p--) {
-    byte digit = (arg >> (p * 4)) & 0x0f;
-    for (char bit = 3; bit >= 0; bit--) {
-      LED_ON;
-      delay(50);
-      LED_OFF;
-      delay(200);
-      if ((digit & (1 << bit)) > 0) {
-        LED_ON;
-        delay(50);
-        LED_OFF;
-        delay(200);
-      } else {
-        delay(250);
-      }
-      deep_sleep(WD_TIMEOUT_1000ms);
-    }
+// Timer0 is clocked with CK/1024, one tick is ~1 ms
+#define SCHED_PRESCALER 1024UL
+#define SCHED_TICKS(ms) ((unsigned int) (((ms) * (F_CPU / SCHED_PRESCALER) + 500UL) / 1000UL))
+// step duration is a watchdog timeout, step is slept in power down mode
+#define SCHED_WDT 0x8000
+#define SCHED_WD(timeout) (SCHED_WDT | (timeout))
+
+struct sched_step {
+  byte outputs;          // combination of O_LED, O_SHUNT, O_LOOP
+  unsigned int duration; // SCHED_TICKS(ms) or SCHED_WD(timeout)
+};
+
+// outputs to apply when the current step has elapsed
+volatile byte sched_outputs;
+// ticks remaining in the current step after the running timer period
+volatile unsigned int sched_ticks;
+
+#ifdef SHUNT_PWM
+// shunt output is driven by Timer1 PWM (OC1B) instead of the port register
+bool shunt_pwm = false;
+#endif
+
+void set_outputs(byte outputs) {
+#ifdef TEMPERATURE
+  // no shunting at high chip temperature
+  if (temperature_hot)
+    outputs &= ~O_SHUNT;
+#endif
+#ifdef SHUNT_PWM
+  if (shunt_pwm && (outputs & O_SHUNT))
+    GTCCR |= _BV(COM1B1);  // OC1B overrides PIN_SHUNT
+  else
+    GTCCR &= ~_BV(COM1B1);
+#endif
+  PORTB = (PORTB & ~SCHED_OUTPUTS) | outputs;
+}
+
+// program the next timer period (at most 256 ticks) of the current step
+void sched_load_period() {
+  byte period = (sched_ticks > 256) ? 255 : sched_ticks - 1;
+  OCR0A = period;
+  sched_ticks -= period + 1;
+}
+
+// Timer0 compare match interrupt (executed when a timer period has elapsed)
+ISR (TIMER0_COMPA_vect) {
+  if (sched_ticks > 0) {
+    sched_load_period();
+    return;
+  }
+  // step has elapsed
+  set_outputs(sched_outputs);
+  TIMSK &= ~_BV(OCIE0A);
+}
+
+// sleep in idle mode for the specified number of scheduler ticks and
+// apply outputs when the time has elapsed
+void sched_wait(unsigned int ticks, byte outputs) {
+  if (ticks == 0) {
+    set_outputs(outputs);
+    return;
+  }
+  sched_outputs = outputs;
+  sched_ticks = ticks;
+
+  power_timer0_enable();
+  TCCR0B = 0;                       // stop timer
+  TCCR0A = _BV(WGM01);              // CTC mode, OC0A/OC0B disconnected
+  TCNT0 = 0;
+  sched_load_period();
+  TIFR = _BV(OCF0A);                // clear pending compare match
+  TIMSK |= _BV(OCIE0A);             // compare match A interrupt enable
+  TCCR0B = _BV(CS02) | _BV(CS00);   // start timer, CK/1024
+
+  set_sleep_mode(SLEEP_MODE_IDLE);
+  noInterrupts();      // disable interrupts to assure deterministic execution
+  while (TIMSK & _BV(OCIE0A)) {
+    sleep_enable();
+    interrupts();      // enable interrupts
+    sleep_cpu();       // go to sleep
+    // ZZZZZZ....
+    sleep_disable();   // wake up
+    noInterrupts();
+  }
+  interrupts();
+
+  TCCR0B = 0;                       // stop timer
+  power_timer0_disable();
+  time_advance(ticks);
+}
+
+// sleep in idle mode for the specified number of scheduler ticks, outputs unchanged
+void idle_sleep(unsigned int ticks) {
+  sched_wait(ticks, PORTB & SCHED_OUTPUTS);
+}
+
+// run the specified pattern (stored in PROGMEM), the outputs of the
+// last step are kept
+void sched_run(const sched_step *steps, byte count) {
+  byte outputs = pgm_read_byte(&steps->outputs);
+  set_outputs(outputs);
+
+  while (count-- > 0) {
+    unsigned int duration = pgm_read_word(&steps->duration);
+    steps++;
+    if (count > 0)
+      outputs = pgm_read_byte(&steps->outputs);
+
+    if (duration & SCHED_WDT) {
+      deep_sleep((byte) duration);
+      set_outputs(outputs);
+    } else {
+      sched_wait(duration, outputs);
+    }
+  }
+}
+
+// Output patterns (see timing diagrams SDS00009, SDS00013, SDS00015, SDS00016)
+
+// normal state: short LED pulse, followed by deep sleep for the adaptive period
+const sched_step p_Norm[] PROGMEM = {
+  { O_LOOP | O_LED,   SCHED_TICKS(20) },
+  { O_LOOP,           0 } };
+
+// normal state after recent LVC/HVC: inverted LED pulse
+const sched_step p_NormInverted[] PROGMEM = {
+  { O_LOOP,           SCHED_TICKS(20) },
+  { O_LOOP | O_LED,   0 } };
+
+#ifdef LOOP_WARNING
+// normal state close to LVC: 100 ms loop warning pulse along with the LED pulse
+const sched_step p_NormWarning[] PROGMEM = {
+  { O_LED,            SCHED_TICKS(100) },
+  { O_LOOP,           0 } };
+
+const sched_step p_NormWarningInverted[] PROGMEM = {
+  { 0,                SCHED_TICKS(100) },
+  { O_LOOP | O_LED,   0 } };
+#endif
+
+// normal state, shunting: slow flash, shunt on except for the last 100 ms
+// (LOOP_WARNING: loop open during the last 100 ms)
+const sched_step p_Shunting[] PROGMEM = {
+  { O_LOOP | O_SHUNT,         SCHED_WD(WD_TIMEOUT_500ms) },
+  { O_LOOP | O_SHUNT | O_LED, SCHED_WD(WD_TIMEOUT_500ms) },
+  { O_LOOP_WARN | O_LED,      SCHED_TICKS(100) } };
+
+// HVC: rapid flash (repeated 10 times), shunt on
+const sched_step p_HVCFlash[] PROGMEM = {
+  { O_SHUNT,          SCHED_TICKS(50) },
+  { O_SHUNT | O_LED,  SCHED_TICKS(50) } };
+
+// HVC: shunt off for the last 100 ms
+const sched_step p_HVCTail[] PROGMEM = {
+  { O_LED,            SCHED_TICKS(100) } };
+
+// invalid state: flash (repeated 3 times)
+const sched_step p_Invalid[] PROGMEM = {
+  { O_LOOP | O_LED,   SCHED_TICKS(166) },
+  { O_LOOP,           SCHED_TICKS(166) } };
+
+// boot signature (see setup())
+const sched_step p_Boot[] PROGMEM = {
+  { O_LED,            SCHED_TICKS(50) },
+  { 0,                SCHED_TICKS(50) } };
+
+const sched_step p_BootNorm[] PROGMEM = {
+  { O_LOOP | O_LED,   SCHED_TICKS(50) },
+  { O_LOOP,           SCHED_TICKS(50) } };
+
+#ifdef SELF_CALIBRATION
+// self calibration done: LED on for 2 s
+const sched_step p_Calibrated[] PROGMEM = {
+  { O_LED,            SCHED_WD(WD_TIMEOUT_2000ms) },
+  { 0,                0 } };
+#endif
+
+#ifdef SHUNT_PWM
+// normal state, shunting with PWM: slow flash, shunt on except for the measurement,
+// CPU sleeps in idle mode to keep the PWM running (LOOP_WARNING: loop open
+// during the last 100 ms)
+const sched_step p_ShuntingPwm[] PROGMEM = {
+  { O_LOOP | O_SHUNT,              SCHED_TICKS(500) },
+  { O_LOOP | O_SHUNT | O_LED,      SCHED_TICKS(500) },
+  { O_LOOP_WARN | O_SHUNT | O_LED, SCHED_TICKS(100) } };
+#endif
+
+#define PATTERN(p) p, sizeof(p) / sizeof(p[0])
+
+#ifdef SHUNT_PWM
+//////////////////////////////////////////////////////////////////////////
+// Shunt PWM
+// Timer1 in PWM mode B: OC1B (PIN_SHUNT) is set at BOTTOM and cleared on
+// compare match with OCR1B, the period is 125 ticks of CK/8 (1 kHz at 1 MHz).
+// The PWM output is connected by set_outputs() whenever O_SHUNT is set.
+
+#define SHUNT_PWM_TOP 124
+
+// calculate PWM duty cycle (in %) for the current cell voltage
+byte shunt_pwm_duty() {
+  return cell_shunt_duty(cell, c_CellParams, c_ShuntPwmMinDuty, c_ShuntPwmFullVoltage);
+}
+
+// start shunt PWM with the given duty cycle (in %)
+// 100 % uses the plain port output, Timer1 is not started
+void shunt_pwm_start(byte duty) {
+  if (duty >= 100)
+    return;
+
+  power_timer1_enable();
+  TCCR1 = 0;                        // stop timer
+  TCNT1 = 0;
+  OCR1C = SHUNT_PWM_TOP;
+  OCR1B = ((unsigned int) duty * (SHUNT_PWM_TOP + 1)) / 100;
+  GTCCR = _BV(PWM1B);               // PWM mode B, OC1B not yet connected
+  TCCR1 = _BV(CS12);                // start timer, CK/8
+  shunt_pwm = true;
+}
+
+// stop shunt PWM, shunt is switched off
+void shunt_pwm_stop() {
+  if (! shunt_pwm)
+    return;
+
+  shunt_pwm = false;
+  GTCCR = 0;                        // disconnect OC1B
+  SHUNT_OFF;
+  TCCR1 = 0;                        // stop timer
+  power_timer1_disable();
+}
+#endif
+
+#ifdef SHUNT_MEASUREMENT
+//////////////////////////////////////////////////////////////////////////
+// Shunt measurement
+// The cell voltage is measured once with the shunt off (regular measurement)
+// and once with the shunt fully on. The shunt current is derived from
+// the shunt-on voltage, the voltage drop is caused by R1 and the cell
+// internal resistance (including wiring).
+
+// estimated shunt current (mA)
+unsigned int shunt_current = 0;
+// estimated shunt power (mW) while the shunt is on
+unsigned int shunt_power = 0;
+// estimated cell internal resistance (mOhm), including wiring
+unsigned int cell_resistance = 0;
+// energy dissipated by the shunt since power up (J)
+unsigned long shunt_energy = 0;
+// not yet accounted energy (mJ)
+unsigned int shunt_energy_remainder = 0;
+
+// measure with shunt on (LED must be off), vcc_off is the shunt-off voltage
+// (mV) of the current cycle, on_time the shunt-on time (ms) of this cycle
+void shunt_measure(unsigned int vcc_off, unsigned int on_time) {
+#ifdef TEMPERATURE
+  // shunt is inhibited, nothing to measure
+  if (temperature_hot) {
+    shunt_current = 0;
+    shunt_power = 0;
+    cell_resistance = 0;
+    return;
+  }
+#endif
+#ifdef SHUNT_PWM
+  // shunt fully on during the measurement
+  bool pwm = shunt_pwm;
+  shunt_pwm = false;
+  set_outputs(PORTB & SCHED_OUTPUTS);
+#endif
+  unsigned int vcc_on = readVcc();
+
+  CLOCK_BURST_BEGIN();
+  shunt_current = ((unsigned long) vcc_on * 1000) / c_ShuntResistance;
+  shunt_power = ((unsigned long) vcc_on * shunt_current) / 1000;
+
+  cell_resistance = 0;
+  if ((vcc_off > vcc_on) && (shunt_current > 0)) {
+    unsigned long r = ((unsigned long) (vcc_off - vcc_on) * 1000) / shunt_current;
+    if (r > c_SeriesResistance)
+      cell_resistance = r - c_SeriesResistance;
+  }
+
+  // accumulate dissipated energy
+  unsigned long energy = ((unsigned long) shunt_power * on_time) / 1000 + shunt_energy_remainder;
+  shunt_energy += energy / 1000;
+  shunt_energy_remainder = energy % 1000;
+  CLOCK_BURST_END();
+
+#ifdef SHUNT_PWM
+  // Timer1 PWM runs at F_CPU again
+  shunt_pwm = pwm;
+  set_outputs(PORTB & SCHED_OUTPUTS);
+#endif
+}
+#endif
+
+#ifdef CAPTURE
+//////////////////////////////////////////////////////////////////////////
+// Transient capture
+// A regular measurement at least c_CaptureThreshold away from the averaged
+// cell voltage arms the capture for c_CaptureArmTime. While armed the normal
+// state samples Vcc at c_CaptureRate instead of sleeping in power down. The
+// raw 10 bit ADC values go into a RAM ring of 8 bit deltas (saturated, the
+// encoder follows the decoded value), the first sample beyond
+// c_CaptureThreshold triggers the capture. c_CapturePostTrigger samples later
+// the ring is complete, the rest of the ring is the pre-trigger history, and
+// it is sent via telemetry at the end of the cycle.
+// Timer0 (compare match B, CPU in idle mode) paces the samples, each sample
+// is a single conversion in ADC noise reduction mode. Timer0 stops during the
+// conversion, the timer period is shortened by the conversion time.
+// The main loop runs between the sampling periods as usual, each sample is
+// also checked against the fast trip thresholds and a fast trip ends the
+// sampling period immediately.
+
+static_assert((c_CaptureRate >= 100) && (c_CaptureRate <= 1000), "c_CaptureRate out of range");
+static_assert(((c_CaptureSamples & (c_CaptureSamples - 1)) == 0) && (c_CaptureSamples <= 128),
+  "c_CaptureSamples must be a power of two (at most 128)");
+static_assert(c_CaptureSamples <= (RAMEND + 1 - RAMSTART) / 4, "c_CaptureSamples too large for this chip");
+static_assert(c_CapturePostTrigger < c_CaptureSamples, "c_CapturePostTrigger must be smaller than c_CaptureSamples");
+
+// Timer0 prescaler (CK/8 or CK/64) and compare value for the sampling period
+const unsigned int c_CapturePrescaler = (F_CPU / 8 / c_CaptureRate <= 256) ? 8 : 64;
+const byte c_CaptureCS = (c_CapturePrescaler == 8) ? _BV(CS01) : (_BV(CS01) | _BV(CS00));
+const byte c_CaptureOcr = F_CPU / c_CapturePrescaler / c_CaptureRate - 1 -
+  (c_AdcConversionTime * (F_CPU / c_CapturePrescaler)) / 1000000UL;
+const unsigned int c_CapturePeriodUs = 1000000UL / c_CaptureRate;
+
+// delta marking a gap in the sampling (main loop between sampling periods)
+const int8_t c_CaptureGap = -128;
+
+enum { e_CaptureOff, e_CaptureArmed, e_CaptureTriggered, e_CaptureDone };
+
+// telemetry frame payload, delta[] is the ring until the capture is done
+struct frame_capture {
+  unsigned int base;         // ADC value before the first delta
+  unsigned int rate;         // samples per second
+  byte trigger;              // position of the trigger sample in delta[]
+  byte count;                // number of deltas
+  int8_t delta[c_CaptureSamples];
+};
+
+frame_capture capture;
+byte capture_state = e_CaptureOff;
+// next ring position, decoded value of the newest sample
+byte capture_head;
+unsigned int capture_last;
+// samples remaining after the trigger
+byte capture_post;
+// arming time left (in s)
+unsigned int capture_countdown = 0;
+// sampling period elapsed (Timer0 compare match B)
+volatile bool capture_tick;
+
+ISR (TIMER0_COMPB_vect) {
+  capture_tick = true;
+}
+
+// calibration factor for converting between mV and raw ADC values
+inline unsigned long capture_factor() {
+#ifdef SELF_CALIBRATION
+  return calibration_factor;
+#else
+  return calibration_factor_custom;
+#endif
+}
+
+// append a delta to the ring, the oldest delta is moved into the base
+void capture_put(int8_t delta) {
+  if (capture.count == c_CaptureSamples) {
+    if (capture.delta[capture_head] != c_CaptureGap)
+      capture.base += capture.delta[capture_head];
+  } else {
+    capture.count++;
+  }
+  capture.delta[capture_head] = delta;
+  capture_head = (capture_head + 1) & (c_CaptureSamples - 1);
+}
+
+// append a sample (raw ADC value)
+void capture_sample(unsigned int adc) {
+  if (capture.count == 0) {
+    capture.base = adc;
+    capture_last = adc;
+  }
+  int delta = (int) adc - (int) capture_last;
+  if (delta > 127)
+    delta = 127;
+  else if (delta < -127)
+    delta = -127;
+  capture_last += delta;
+  capture_put(delta);
+}
+
+// reverse delta[first .. last]
+void capture_reverse(byte first, byte last) {
+  while (first < last) {
+    int8_t d = capture.delta[first];
+    capture.delta[first++] = capture.delta[last];
+    capture.delta[last--] = d;
+  }
+}
+
+// put the ring into chronological order, the capture is sent at the end of the cycle
+void capture_finish() {
+  // oldest delta
+  byte tail = (capture_head - capture.count) & (c_CaptureSamples - 1);
+  if (tail) {
+    // rotate left by tail
+    capture_reverse(0, tail - 1);
+    capture_reverse(tail, c_CaptureSamples - 1);
+    capture_reverse(0, c_CaptureSamples - 1);
+  }
+  capture.trigger = (capture.trigger - tail) & (c_CaptureSamples - 1);
+  capture.rate = c_CaptureRate;
+  capture_state = e_CaptureDone;
+}
+
+// arm or disarm the capture after the regular measurement (vcc) of the cycle
+void capture_update(unsigned int vcc, byte elapsed) {
+  if (capture_state == e_CaptureDone)
+    return;
+  capture_countdown = (capture_countdown > elapsed) ? capture_countdown - elapsed : 0;
+
+  if ((cell.cellstate != e_CellNorm) || cell.shunting) {
+    // the captures are taken in normal state only
+    capture_state = e_CaptureOff;
+    return;
+  }
+  if ((vcc >= cell.cellvoltage + c_CaptureThreshold) || (vcc + c_CaptureThreshold <= cell.cellvoltage)) {
+    if (capture_state == e_CaptureOff) {
+      capture.count = 0;
+      capture_head = 0;
+      capture_state = e_CaptureArmed;
+    }
+    capture_countdown = c_CaptureArmTime;
+  } else if ((capture_state == e_CaptureArmed) && (capture_countdown == 0)) {
+    capture_state = e_CaptureOff;
+  }
+}
+
+inline bool capture_active() {
+  return (capture_state == e_CaptureArmed) || (capture_state == e_CaptureTriggered);
+}
+
+// sample for the specified number of Timer0 ticks at CK/1024 (replaces the
+// power down sleep of the cycle), returns early when the capture is complete
+// or on a fast trip
+void capture_run(unsigned int ticks) {
+  unsigned int samples = ((unsigned long) ticks * TIME_TICK_US) / c_CapturePeriodUs;
+
+  // thresholds as raw ADC values (the ADC value falls with rising Vcc)
+  const unsigned long factor = capture_factor();
+  unsigned int trigger_low = factor / (cell.cellvoltage + c_CaptureThreshold);
+  unsigned int trigger_high = factor / (cell.cellvoltage - c_CaptureThreshold);
+  unsigned int trip_low = 0;
+  unsigned int trip_high = 0xffff;
+  if (c_CellParams.fast_trip_margin) {
+    trip_low = factor / (c_CellParams.hv_engage + c_CellParams.fast_trip_margin);
+    trip_high = factor / (c_CellParams.lv_engage - c_CellParams.fast_trip_margin);
+  }
+
+  if (capture.count)
+    capture_put(c_CaptureGap);
+
+  adc_enable();
+  for (byte ii = 0; ii < c_AdcSettleConversions; ii++) {
+    adc_convert();
+  }
+
+  power_timer0_enable();
+  TCCR0B = 0;                       // stop timer
+  TCCR0A = _BV(WGM01);              // CTC mode, OC0A/OC0B disconnected
+  OCR0A = c_CaptureOcr;
+  OCR0B = c_CaptureOcr;
+  TCNT0 = 0;
+  TIFR = _BV(OCF0B);                // clear pending compare match
+  TIMSK |= _BV(OCIE0B);             // compare match B interrupt enable
+  capture_tick = false;
+  TCCR0B = c_CaptureCS;             // start timer
+
+  unsigned int done = 0;
+  while (done < samples) {
+    // wait for the sampling period in idle mode
+    set_sleep_mode(SLEEP_MODE_IDLE);
+    noInterrupts();
+    while (! capture_tick) {
+      sleep_enable();
+      interrupts();
+      sleep_cpu();
+      // ZZZZZZ....
+      sleep_disable();
+      noInterrupts();
+    }
+    capture_tick = false;
+    interrupts();
+
+    unsigned int adc = adc_convert();
+    done++;
+    capture_sample(adc);
+
+    if ((adc < trip_low) || (adc > trip_high)) {
+      unsigned int vcc = adc_to_vcc_custom(adc << c_AdcOversamplingBits);
+      if (cell_fast_trip(cell, c_CellParams, vcc)) {
+        cell.cellvoltage = moving_average_fill(avg, vcc);
+        break;
+      }
+    }
+    if (capture_state == e_CaptureArmed) {
+      if ((adc <= trigger_low) || (adc >= trigger_high)) {
+        capture.trigger = (capture_head - 1) & (c_CaptureSamples - 1);
+        capture_post = c_CapturePostTrigger;
+        capture_state = e_CaptureTriggered;
+      }
+    } else if (--capture_post == 0) {
+      capture_finish();
+      break;
+    }
+  }
+
+  TCCR0B = 0;                       // stop timer
+  TIMSK &= ~_BV(OCIE0B);
+  power_timer0_disable();
+  ADCSRA &= ~_BV(ADEN);
+  power_adc_disable();
+
+  time_advance(((unsigned long) done * c_CapturePeriodUs) / TIME_TICK_US);
+}
+#endif
+
+#if defined(DEBUG) || defined(OPTICAL)
+//////////////////////////////////////////////////////////////////////////
+// Telemetry
+// TX only UART (9600 Baud 8N1) on the USI data output DO (PIN_LED). The USI
+// is clocked by the Timer0 compare match at the bit rate and shifts out each
+// byte in two parts, the USI counter overflow interrupt loads the next part.
+// Each part starts with the bit currently on the line, so the output never
+// glitches while the interrupt reloads the data register. The CPU sleeps in
+// idle mode while the bytes go out.
+// NOTE: the LED is on while the line is idle during a transmission.
+//
+// Optical readout (OPTICAL): the same frames are sent Manchester coded
+// (OPTICAL_BAUD, LSB first, 0: LED on -> off, 1: LED off -> on in the middle
+// of the bit, IEEE 802.3) through the LED for a phototransistor probe. The
+// USI shifts out chips (half bits) at twice the bit rate, each part is the
+// chip on the line plus 7 new chips. A transmission starts with two preamble
+// bytes (0x55) for the clock recovery, the LED is off while idle.
+//
+// Frames: 0xA5, type, payload length, payload (little endian), CRC8 (Dallas/
+// Maxim) over type, length and payload. See tools/telemetry for a decoder.
+
+#define TELEMETRY_BAUD 9600UL
+
+// Timer0 clock select and compare value for the bit rate
+#if F_CPU / TELEMETRY_BAUD <= 256
+#define TELEMETRY_PRESCALER 1
+#define TELEMETRY_CS        _BV(CS00)
+#else
+#define TELEMETRY_PRESCALER 8
+#define TELEMETRY_CS        _BV(CS01)
+#endif
+#define TELEMETRY_OCR ((F_CPU / TELEMETRY_PRESCALER + TELEMETRY_BAUD / 2) / TELEMETRY_BAUD - 1)
+
+#define TELEMETRY_SYNC 0xa5
+
+#ifdef OPTICAL
+#define OPTICAL_BAUD 500UL
+
+// Timer0 clock select and compare value for the chip rate (twice the bit rate)
+#if F_CPU / (2 * OPTICAL_BAUD) <= 256
+#define OPTICAL_PRESCALER 1
+#define OPTICAL_CS        _BV(CS00)
+#elif F_CPU / (2 * OPTICAL_BAUD) <= 2048
+#define OPTICAL_PRESCALER 8
+#define OPTICAL_CS        _BV(CS01)
+#else
+#define OPTICAL_PRESCALER 64
+#define OPTICAL_CS        (_BV(CS01) | _BV(CS00))
+#endif
+#define OPTICAL_OCR ((F_CPU / OPTICAL_PRESCALER + OPTICAL_BAUD) / (2 * OPTICAL_BAUD) - 1)
+// length of a chip in us
+#define OPTICAL_CHIP_US (1000000UL / (2 * OPTICAL_BAUD))
+
+// two preamble bytes 0x55 as chips (MSB first)
+const unsigned long c_OpticalPreamble = 0x66666666UL;
+#endif
+
+// frame types
+enum {
+  e_FrameBoot = 1,
+  e_FrameStatus,
+  e_FrameShunt,
+  e_FrameProfile,
+  e_FrameCalibration,
+  e_FrameTemperature,
+  e_FrameLog,
+  e_FrameCapture,
+  e_FrameStatistics };
+
+// transmit ring buffer (holds bit reversed bytes, the USI shifts MSB first)
+#define TX_BUFFER_SIZE 32
+byte tx_buffer[TX_BUFFER_SIZE];
+volatile byte tx_head = 0;
+volatile byte tx_tail = 0;
+// second part of the byte currently being sent
+volatile byte tx_second;
+// 0: between bytes, 1: second part pending, 2: final stop bit
+volatile byte tx_phase;
+volatile bool tx_active = false;
+
+#ifdef OPTICAL
+// send via the optical transport instead of the UART
+bool tx_optical = false;
+// chips not yet loaded into the USI (left aligned, MSB first) and their number
+unsigned long tx_chips;
+byte tx_chip_count;
+// chip on the line (last chip of the current part)
+byte tx_line;
+// chips sent since the start of the transmission
+unsigned int tx_chips_sent;
+
+// Manchester code of a bit reversed byte (16 chips, MSB first)
+unsigned int manchester(byte r) {
+  unsigned int chips = 0;
+  for (byte ii = 0; ii < 8; ii++) {
+    chips = (chips << 2) | ((r & 0x80) ? 0b01 : 0b10);
+    r <<= 1;
+  }
+  return chips;
+}
+
+// load the next part of the optical transmission into the USI
+inline void optical_next() {
+  if ((tx_chip_count < 7) && (tx_tail != tx_head)) {
+    byte r = tx_buffer[tx_tail];
+    tx_tail = (tx_tail + 1) & (TX_BUFFER_SIZE - 1);
+    tx_chips |= (unsigned long) manchester(r) << (16 - tx_chip_count);
+    tx_chip_count += 16;
+  }
+  if ((tx_chip_count == 0) && (tx_line == 0)) {
+    // transmission complete, LED idle (off)
+    USICR = 0;
+    TCCR0B = 0;
+    tx_active = false;
+    return;
+  }
+  // the remaining chips are padded with idle chips (LED off)
+  byte part = tx_chips >> 25;
+  tx_chips <<= 7;
+  tx_chip_count = (tx_chip_count > 7) ? tx_chip_count - 7 : 0;
+  USIDR = (tx_line << 7) | part;
+  USISR = _BV(USIOIF) | (16 - 7);
+  tx_line = part & 1;
+  tx_chips_sent += 7;
+}
+#endif
+
+// USI counter overflow interrupt (executed when the current part has been shifted out)
+ISR (USI_OVF_vect) {
+#ifdef OPTICAL
+  if (tx_optical) {
+    optical_next();
+    return;
+  }
+#endif
+  if (tx_phase == 1) {
+    // DO shows bit 5, continue with bits 5 - 7 and the stop bit
+    USIDR = tx_second;
+    USISR = _BV(USIOIF) | (16 - 3);
+    tx_phase = 0;
+    return;
+  }
+  if (tx_tail != tx_head) {
+    // DO shows the stop bit, continue with start bit and bits 0 - 5
+    byte r = tx_buffer[tx_tail];
+    tx_tail = (tx_tail + 1) & (TX_BUFFER_SIZE - 1);
+    USIDR = 0x80 | (r >> 2);
+    tx_second = (r << 5) | 0x1f;
+    USISR = _BV(USIOIF) | (16 - 7);
+    tx_phase = 1;
+    return;
+  }
+  if (tx_phase == 0) {
+    // hold the stop bit for a full bit period
+    USIDR = 0xff;
+    USISR = _BV(USIOIF) | (16 - 1);
+    tx_phase = 2;
+    return;
+  }
+  // transmission complete, PIN_LED is controlled by the port register again
+  USICR = 0;
+  TCCR0B = 0;
+  tx_active = false;
+}
+
+// start transmission if not already running
+void telemetry_start() {
+  if (tx_active)
+    return;
+  tx_active = true;
+  tx_phase = 0;
+
+  power_timer0_enable();
+  power_usi_enable();
+  TCCR0B = 0;                       // stop timer
+  TCCR0A = _BV(WGM01);              // CTC mode
+  TCNT0 = 0;
+#ifdef OPTICAL
+  if (tx_optical) {
+    OCR0A = OPTICAL_OCR;
+    tx_chips = c_OpticalPreamble;
+    tx_chip_count = 32;
+    tx_line = 0;
+    // idle line (LED off) for one chip before the preamble
+    USIDR = 0x00;
+    USISR = _BV(USIOIF) | (16 - 1);
+    USICR = _BV(USIOIE) | _BV(USIWM0) | _BV(USICS0);
+    TCCR0B = OPTICAL_CS;
+    return;
+  }
+#endif
+  OCR0A = TELEMETRY_OCR;
+
+  // idle line for one bit period before the first start bit
+  USIDR = 0xff;
+  USISR = _BV(USIOIF) | (16 - 1);
+  USICR = _BV(USIOIE) | _BV(USIWM0) | _BV(USICS0);  // three wire mode, clocked by Timer0 compare match
+  TCCR0B = TELEMETRY_CS;            // start timer
+}
+
+// sleep in idle mode until the condition is met (woken up by the USI interrupt)
+#define telemetry_sleep_while(cond) do { \
+    set_sleep_mode(SLEEP_MODE_IDLE); \
+    noInterrupts(); \
+    while (cond) { \
+      sleep_enable(); \
+      interrupts(); \
+      sleep_cpu(); \
+      sleep_disable(); \
+      noInterrupts(); \
+    } \
+    interrupts(); \
+  } while (0)
+
+void telemetry_put(byte value) {
+  // bit reverse, UART sends LSB first
+  byte r = 0;
+  for (byte ii = 0; ii < 8; ii++) {
+    r = (r << 1) | (value & 1);
+    value >>= 1;
+  }
+
+  byte next = (tx_head + 1) & (TX_BUFFER_SIZE - 1);
+  if (next == tx_tail) {
+    // buffer full, wait for the transmission to make room
+    telemetry_start();
+    telemetry_sleep_while(next == tx_tail);
+  }
+  tx_buffer[tx_head] = r;
+  tx_head = next;
+}
+
+// queue frame, the frame is sent by telemetry_flush() or when the buffer is full
+void telemetry_frame(byte type, const void *payload, byte length) {
+  const byte *p = (const byte *) payload;
+  byte crc = _crc_ibutton_update(0, type);
+  crc = _crc_ibutton_update(crc, length);
+
+  telemetry_put(TELEMETRY_SYNC);
+  telemetry_put(type);
+  telemetry_put(length);
+  for (byte ii = 0; ii < length; ii++) {
+    crc = _crc_ibutton_update(crc, p[ii]);
+    telemetry_put(p[ii]);
+  }
+  telemetry_put(crc);
+}
+
+// send all queued bytes, the CPU sleeps in idle mode until the transmission is complete
+void telemetry_flush() {
+  if (tx_head != tx_tail)
+    telemetry_start();
+  telemetry_sleep_while(tx_active);
+  power_usi_disable();
+  power_timer0_disable();
+}
+
+// frame payloads
+struct frame_boot {
+  unsigned long calibration_factor_default;
+  unsigned long calibration_factor_custom;
+  byte flags;            // bit 0: calibration mode, bit 1: calibration from EEPROM
+  byte profile_tick;     // length of a profile tick in us (0: no profiling)
+};
+
+struct frame_status {
+  unsigned int cellvoltage;  // averaged cell voltage (mV)
+  unsigned int vcc;          // measurement of this cycle (mV)
+  byte cellstate;
+  byte cellstate_pending;
+  unsigned int cellstate_pending_age;
+  byte shunting;             // bit 0: shunting, bit 1: shunting pending
+  unsigned int shunting_pending_age;
+  unsigned int last_cutoff_age;
+  int trend;                 // voltage trend (1/256 mV/s)
+};
+
+#ifdef SHUNT_MEASUREMENT
+struct frame_shunt {
+  unsigned int current;      // mA
+  unsigned int power;        // mW
+  unsigned int resistance;   // mOhm
+  unsigned long energy;      // J
+};
+#endif
+
+#ifdef TEMPERATURE
+struct frame_temperature {
+  int temperature;           // chip temperature (°C)
+  unsigned int adc_value;    // averaged temperature sensor ADC value
+  byte flags;                // bit 0: shunting inhibited
+};
+#endif
+
+struct frame_calibration {
+  unsigned int adc_value;    // averaged ADC value
+  unsigned int vcc_default;  // Vcc (uncalibrated, mV)
+  unsigned int vcc_custom;   // Vcc (calibrated, mV)
+};
+
+void telemetry_boot() {
+  frame_boot f;
+  f.calibration_factor_default = calibration_factor_default;
+#ifdef CALIBRATION_MODE
+  f.flags = 1;
+#else
+  f.flags = 0;
+#endif
+#ifdef SELF_CALIBRATION
+  f.calibration_factor_custom = calibration_factor;
+  if (calibration_stored)
+    f.flags |= 2;
+#else
+  f.calibration_factor_custom = calibration_factor_custom;
+#endif
+#ifdef PROFILE
+  f.profile_tick = PROFILE_TICK_US;
+#else
+  f.profile_tick = 0;
+#endif
+  telemetry_frame(e_FrameBoot, &f, sizeof(f));
+}
+
+#ifdef STATISTICS
+// send the statistics with the band layout
+void telemetry_statistics() {
+  struct {
+    unsigned int band_min;     // lower bound of the first band (mV)
+    byte band_shift;           // band width 2^band_shift mV
+    statistics s;
+  } f;
+
+  f.band_min = c_StatisticsMin;
+  f.band_shift = c_StatisticsBandShift;
+  f.s = stats;
+  telemetry_frame(e_FrameStatistics, &f, sizeof(f));
+  stats_report = false;
+}
+#endif
+
+void telemetry_status(unsigned int vcc) {
+  frame_status f;
+  f.cellvoltage = cell.cellvoltage;
+  f.vcc = vcc;
+  f.cellstate = cell.cellstate;
+  f.cellstate_pending = cell.cellstate_pending;
+  f.cellstate_pending_age = cell.cellstate_pending_age;
+  f.shunting = (cell.shunting ? 1 : 0) | (cell.shunting_pending ? 2 : 0);
+  f.shunting_pending_age = cell.shunting_pending_age;
+  f.last_cutoff_age = cell.last_cutoff_age;
+  f.trend = cell.trend;
+  telemetry_frame(e_FrameStatus, &f, sizeof(f));
+
+#ifdef SHUNT_MEASUREMENT
+  frame_shunt s;
+  s.current = shunt_current;
+  s.power = shunt_power;
+  s.resistance = cell_resistance;
+  s.energy = shunt_energy;
+  telemetry_frame(e_FrameShunt, &s, sizeof(s));
+#endif
+#ifdef TEMPERATURE
+  frame_temperature t;
+  t.temperature = temperature;
+  t.adc_value = temperature_adc;
+  t.flags = temperature_hot ? 1 : 0;
+  telemetry_frame(e_FrameTemperature, &t, sizeof(t));
+#endif
+#ifdef PROFILE
+  telemetry_frame(e_FrameProfile, &profile, sizeof(profile));
+#endif
+#ifdef STATISTICS
+  if (stats_report)
+    telemetry_statistics();
+#endif
+#ifdef CAPTURE
+  if (capture_state == e_CaptureDone) {
+    telemetry_frame(e_FrameCapture, &capture, sizeof(capture) - c_CaptureSamples + capture.count);
+    capture_state = e_CaptureOff;
+  }
+#endif
+}
+
+#ifdef EVENT_LOG
+// send all event log records (slot number followed by the record)
+void telemetry_log() {
+  struct {
+    byte slot;
+    log_record r;
+  } f;
+
+  log_wait();
+  for (f.slot = 0; f.slot < c_LogRecords; f.slot++) {
+    eeprom_read_block(&f.r, (const void *) (f.slot * sizeof(log_record)), sizeof(f.r));
+    if (f.r.type != e_LogEmpty)
+      telemetry_frame(e_FrameLog, &f, sizeof(f));
+  }
+}
+#endif
+
+void telemetry_calibration(unsigned int adc_value) {
+  frame_calibration f;
+  f.adc_value = adc_value;
+  f.vcc_default = adc_to_vcc(calibration_factor_default, adc_value);
+  f.vcc_custom = adc_to_vcc(calibration_factor_custom, adc_value);
+  telemetry_frame(e_FrameCalibration, &f, sizeof(f));
+}
+
+#ifdef OPTICAL
+// time_ms of the last optical readout
+unsigned long optical_last = 0;
+
+// send the queued frames through the LED
+void optical_flush() {
+  // frames queued for the UART go out first
+  telemetry_flush();
+  tx_optical = true;
+  tx_chips_sent = 0;
+  telemetry_flush();
+  tx_optical = false;
+  time_advance(((unsigned long) tx_chips_sent * OPTICAL_CHIP_US) / TIME_TICK_US);
+}
+
+// optical readout: boot information, current status (including the shunt,
+// temperature and profiling frames), a calibration reading and the event log
+void optical_readout(unsigned int vcc) {
+  LED_OFF;
+  unsigned int adc_value = readADC();
+#ifdef STATISTICS
+  stats_report = true;
+#endif
+  telemetry_boot();
+  telemetry_status(vcc);
+  telemetry_calibration(adc_value);
+#ifdef EVENT_LOG
+  telemetry_log();
+#endif
+  optical_flush();
+  optical_last = time_ms;
+}
+
+// a readout is due in normal state every c_OpticalInterval
+inline bool optical_due() {
+  return c_OpticalInterval && (cell.cellstate == e_CellNorm) &&
+    (time_ms - optical_last >= c_OpticalInterval * 1000UL);
+}
+#endif
+#endif
+
+// blink_int() patterns: rapid flash, short flash
+const sched_step p_BlinkStart[] PROGMEM = {
+  { O_LED,            SCHED_TICKS(10) },
+  { 0,                SCHED_TICKS(50) } };
+
+const sched_step p_BlinkFlash[] PROGMEM = {
+  { O_LED,            SCHED_TICKS(50) },
+  { 0,                SCHED_TICKS(200) } };
+
+// blinks argument as 4 digit hex number
+// signal 4 bit per digit
+//   1 is encoded as two short flashes
+//   0 is encoded as one short flash
+// digits separated by a longer pause
+void blink_int(unsigned int arg) {
+  // start with a long burst of rapid flashes to indicate start of sequence
+  for (byte ii = 0; ii < 20; ii++) {
+    sched_run(PATTERN(p_BlinkStart));
+  }
+  deep_sleep(WD_TIMEOUT_1000ms);
+
+  // send BCD encoded decimal digits of the supplied argument
+  // maximum number 4 digit BCD can handle
+
+  for (char p = 3; p >=0; p--) {
+    byte digit = (arg >> (p * 4)) & 0x0f;
+    for (char bit = 3; bit >= 0; bit--) {
+      sched_run(PATTERN(p_BlinkFlash));
+      if ((digit & (1 << bit)) > 0) {
+        sched_run(PATTERN(p_BlinkFlash));
+      } else {
+        idle_sleep(SCHED_TICKS(250));
+      }
+      deep_sleep(WD_TIMEOUT_1000ms);
+    }
     deep_sleep(WD_TIMEOUT_2000ms);
   }
 
 }
+#ifdef SELF_CALIBRATION
+//////////////////////////////////////////////////////////////////////////
+// Self calibration
+// Runs at boot if the EEPROM holds no calibration record: with the module
+// powered from the reference supply the oversampled ADC value is averaged
+// over a long burst and the calibration factor is calculated from the known
+// supply voltage (Vcc = (factor << c_AdcOversamplingBits) / ADC value).
+
+// number of averaged measurements, spaced by 10 ms (~3 s)
+const unsigned int c_CalibrationSamples = 256;
+
+// window for the uncalibrated measurement (mV)
+const unsigned int c_CalibrationMin = c_CalibrationReference * (100UL - c_CalibrationWindow) / 100;
+const unsigned int c_CalibrationMax = c_CalibrationReference * (100UL + c_CalibrationWindow) / 100;
+static_assert(c_CalibrationMin > c_HVoltage_engage, "calibration window overlaps the cell voltage range");
+
+// uncalibrated supply voltage is within the calibration window
+bool calibration_window() {
+  unsigned int vcc = adc_to_vcc(calibration_factor_default, readADC());
+  return (vcc >= c_CalibrationMin) && (vcc <= c_CalibrationMax);
+}
 
-void setup() {
-#ifdef DEBUG
-  // serial debugging
-  mySerial.begin(9600);
-  debugln();
+// returns true if a new calibration factor has been stored
+bool self_calibrate() {
+  if (! calibration_window())
+    return false;
+  // let the reference supply settle, must still be within the window
+  deep_sleep(WD_TIMEOUT_2000ms);
+  if (! calibration_window())
+    return false;
+
+  // at most 256 * 8192 (2^21)
+  unsigned long sum = 0;
+  for (unsigned int ii = 0; ii < c_CalibrationSamples; ii++) {
+    sum += readADC();
+    idle_sleep(SCHED_TICKS(10));
+  }
+
+  // factor = reference * average ADC value >> c_AdcOversamplingBits, keeps
+  // 4 fractional bits of the average (reference * 2^17 fits 32 bits)
+  calibration_store(((unsigned long) c_CalibrationReference * (sum >> 4)) /
+    ((c_CalibrationSamples >> 4) << c_AdcOversamplingBits));
+  return true;
+}
 #endif
 
+void setup() {
   // initialize Port B: configure all pins as OUTPUT
+  // (unused pins PB0 and PB2 are parked as outputs driven low)
   DDRB  = 0b00011111;
 
   // set all outputs to LOW (LED off, Shunt off, Loop open)
   PORTB = 0b00000000;
 
-#ifdef CALIBRATION_MODE
-  #ifdef DEBUG
-  debugln("Calibration mode");
+  // Timer0 is used by the output scheduler, disable the Arduino millis() interrupt
+  // (unused in the bare-metal build)
+  // NOTE: delay() and millis() are not available
+  TIMSK &= ~_BV(TOIE0);
+  TCCR0B = 0;
 
-  debug("Calibration factor default: ");
-  debugln(calibration_factor_default);
-  debug("Calibration factor custom: ");
-  debugln(calibration_factor_custom);
-  #endif
+  power_init();
+
+#ifdef CELL_BUS
+  bus_init();
+#endif
+#ifdef PROFILE
+  profile_init();
+#endif
+#ifdef PROFILE_PIN
+  AUX_HIGH;
+#endif
+#ifdef EVENT_LOG
+  log_init();
+#ifdef STATISTICS
+  stats_init();
+#endif
+#endif
+#ifdef SELF_CALIBRATION
+  if (! calibration_load() && self_calibrate())
+    sched_run(PATTERN(p_Calibrated));
+#endif
+
+#ifndef CALIBRATION_MODE
+  // fast boot: seed the moving average with a burst of measurements and
+  // commit the initial cell state immediately, a good cell closes the loop
+  // right away (the boot signature and optical readout keep it closed)
+  for (byte ii = 0; ii < c_MovingAverageWindow; ii++) {
+    cell.cellvoltage = moving_average(avg, readVcc());
+  }
+  cell_boot(cell, c_CellParams);
+  if (cell.cellstate == e_CellNorm)
+    LOOP_CLOSE;
+  power_policy();
+#endif
+  // the time base runs on the nominal watchdog timeout until here, the
+  // measurement (~256 ms) must not delay the initial cell state
+  wdt_calibrate();
+#ifdef EVENT_LOG
+  log_extremes();
+  log_write(e_LogBoot);
+#endif
 
-  delay(5);
+#ifdef DEBUG
+  telemetry_boot();
+#ifdef EVENT_LOG
+  telemetry_log();
+#endif
+  telemetry_flush();
+#endif
+
+#ifdef CALIBRATION_MODE
+  idle_sleep(SCHED_TICKS(5));
   // initialize moving average with current ADC value
   for (byte ii = 0; ii < c_MovingAverageWindow; ii++) {
-    avg_buffer[ii] = readADC();
-    delay(5);
+    moving_average(avg, readADC());
+    idle_sleep(SCHED_TICKS(5));
   }
 #else
-  // initialize moving average with nominal value
-  for (byte ii = 0; ii < c_MovingAverageWindow; ii++) {
-    avg_buffer[ii] = 3200;
+  // boot signature: 15 short flashes, the loop is only closed in normal state
+  for (byte ii = 0; ii < 15; ii++) {
+    if (cell.cellstate == e_CellNorm)
+      sched_run(PATTERN(p_BootNorm));
+    else
+      sched_run(PATTERN(p_Boot));
   }
+#ifdef OPTICAL
+  // not from a deeply discharged cell
+  if (cell.cellstate != e_CellLVC)
+    optical_readout(cell.cellvoltage);
+#endif
 #endif
-
-  last_cutoff_age = 0;
 }
 
 
 void loop() {
 #ifndef CALIBRATION_MODE
   // normal mode
-  // xor mask for LED (used to invert the LED if recent LVC/HVC has happend)
-  bool invert_led = false;
-
-  if (last_cutoff_age != c_NoCutoffEvent)
-    last_cutoff_age++;
+  if (time_ms - wdt_calibrated >= c_WdtCalibrationInterval * 1000UL)
+    wdt_calibrate();
+  // all ages and timeouts are driven by the time base
+  byte elapsed = time_elapsed();
+  // age of last cutoff event, saturates at c_NoCutoffEvent
+  cell_age(cell, elapsed);
+#ifdef TEMPERATURE
+  temperature_age(elapsed);
+#endif
 
   // cell measurement shall be done without any loads
+  // (readADC() waits for the supply voltage to settle)
+#ifdef SHUNT_PWM
+  shunt_pwm_stop();
+#endif
   LED_OFF;
   SHUNT_OFF;
 
-  delayMicroseconds(200);
-  cellvoltage = moving_average(readVcc(calibration_factor_custom));
+  PROFILE_START(t_adc);
+  unsigned int vcc = readVcc();
+  PROFILE_STOP(t_adc, profile.adc);
+  CLOCK_BURST_BEGIN();
+  cell.cellvoltage = moving_average(avg, vcc);
 
-  determine_cellstate();
+#ifdef EVENT_LOG
+  byte prev_state = cell.cellstate;
+#endif
+  PROFILE_START(t_cellstate);
+  // a sudden collapse (or overshoot) opens the loop without waiting for the
+  // filter, the filter then follows the raw sample
+  if (cell_fast_trip(cell, c_CellParams, vcc))
+    cell.cellvoltage = moving_average_fill(avg, vcc);
+  cell_trend(cell, elapsed);
+  determine_cellstate(cell, c_CellParams, elapsed);
+  PROFILE_STOP(t_cellstate, profile.cellstate);
+  power_policy();
+  CLOCK_BURST_END();
+#ifdef CELL_BUS
+  bus_publish();
+#endif
+#ifdef EVENT_LOG
+  log_update(prev_state, elapsed);
+#endif
+#ifdef STATISTICS
+  stats_update(prev_state, elapsed);
+#endif
+#ifdef CAPTURE
+  capture_update(vcc, elapsed);
+#endif
+
+  // xor mask for LED (used to invert the LED if recent LVC/HVC has happend)
+  bool invert_led = update_cutoff_age(cell, c_CellParams);
 
-  switch (cellstate) {
+  switch (cell.cellstate) {
   case e_CellLVC:
     LOOP_OPEN;
     LED_OFF;
     SHUNT_OFF;
-    last_cutoff_age = 0;
     deep_sleep(WD_TIMEOUT_1000ms);
     break;
   case e_CellNorm:
-    if (last_cutoff_age < c_RecentCutOffDuration) {
-      // recent HVC/LVC happened
-      invert_led = true;
-    } else {
-      // normal state has been stable for some time
-      last_cutoff_age = c_NoCutoffEvent;
-    }
-
-    LOOP_CLOSE;
-
-    if (! shunting) {
+    if (! cell.shunting) {
       // normal cell state
-      SHUNT_OFF;
-
+      byte timeout = adaptive_period();
+#ifdef LOOP_WARNING
+      if (cell.cellvoltage <= c_LoopWarningVoltage) {
+        // approaching LVC
+        if (! invert_led)
+          sched_run(PATTERN(p_NormWarning));
+        else
+          sched_run(PATTERN(p_NormWarningInverted));
+      } else
+#endif
       if (! invert_led)
-        LED_ON;
+        sched_run(PATTERN(p_Norm));
       else
-       LED_OFF;
-      delay(20);
-      if (! invert_led)
-        LED_OFF;
+        sched_run(PATTERN(p_NormInverted));
+#ifdef CAPTURE
+      if (capture_active())
+        capture_run(wdt_timeout_ticks(timeout));
       else
-        LED_ON;
-    
-      deep_sleep(WD_TIMEOUT_1000ms);
+#endif
+      deep_sleep(timeout);
     } else {
       // shunting, but no HVC yet
-      SHUNT_ON;
-
-      LED_OFF;
-      delay(500);
-      LED_ON;
-      delay(500);
-
-      SHUNT_OFF;
-
-      delay(100);
+#ifdef SHUNT_PWM
+      // PWM keeps running until it is stopped for the next measurement
+      byte duty = shunt_pwm_duty();
+      shunt_pwm_start(duty);
+  #ifdef SHUNT_MEASUREMENT
+      // measure at the end of the first step (shunt on, LED off)
+      sched_run(p_ShuntingPwm, 1);
+      shunt_measure(vcc, (1100U * duty) / 100);
+      sched_run(p_ShuntingPwm + 1, 2);
+  #else
+      sched_run(PATTERN(p_ShuntingPwm));
+  #endif
+#else
+  #ifdef SHUNT_MEASUREMENT
+      // measure at the end of the first step (shunt on, LED off)
+      sched_run(p_Shunting, 1);
+      shunt_measure(vcc, 1000);
+      sched_run(p_Shunting + 1, 2);
+  #else
+      sched_run(PATTERN(p_Shunting));
+  #endif
       LED_OFF;
+#endif
     }
     break;
   case e_CellHVC:
-    LOOP_OPEN;
-    SHUNT_ON;
-
-    last_cutoff_age = 0;
     for (byte ii = 0; ii < 10; ii++) {
-      LED_OFF;
-      delay(50);
-      LED_ON;
-      delay(50);
+#ifdef SHUNT_MEASUREMENT
+      if (ii == 5) {
+        // measure at the end of the LED off step (shunt on)
+        sched_run(p_HVCFlash, 1);
+        shunt_measure(vcc, 1000);
+        sched_run(p_HVCFlash + 1, 1);
+        continue;
+      }
+#endif
+      sched_run(PATTERN(p_HVCFlash));
     }
-    SHUNT_OFF;
-    delay(100);
+    sched_run(PATTERN(p_HVCTail));
     break;
   case e_CellInvalid:
     // fall-through intended
   default:
-    LOOP_CLOSE;
-    SHUNT_OFF;
     for (byte ii = 0; ii < 3; ii++) {
-      LED_ON;
-      delay(166);
-      LED_OFF;
-      delay(166);
+      sched_run(PATTERN(p_Invalid));
     }
   }
 
-  #ifdef DEBUG
-    debug("Vcc: ");
-    debug(cellvoltage);
-    debug(" [Cell curr: ");
-    debug(CellStateDescription[cellstate]);
-    debug(" pend: ");
-    debug(CellStateDescription[cellstate_pending]);
-    debug(" age: ");
-    debug(cellstate_pending_age);
-    debug("] [Shunt curr: ");
-    debug(shunting);
-    debug(" pend: ");
-    debug(shunting_pending);
-    debug(" age: ");
-    debug(shunting_pending_age);
-    debug("] cutoffage: ");
-    debug(last_cutoff_age);
-    debugln();
-  #endif
+#ifdef PROFILE
+  profile_cycle_end();
+#endif
+
+#ifdef DEBUG
+  telemetry_status(vcc);
+  telemetry_flush();
+#endif
+#ifdef OPTICAL
+  if (optical_due())
+    optical_readout(vcc);
+#endif
+
+#ifdef PROFILE
+  // exclude the telemetry output from the awake time
+  profile_mark = profile_now();
+#endif
 
 
 #else
   // calibration mode
-  delayMicroseconds(200);
-  long adc_value = moving_average(readADC());
-  #ifdef DEBUG
-   debug("Vcc (uncalibrated): ");
-   debug(calibration_factor_default / adc_value);
-   debug(" Vcc (calibrated): ");
-   debug(calibration_factor_custom / adc_value);
-   debug(" adc averaged value: ");
-   debug(adc_value);
-   debugln("");
-  #endif
-  blink_int(calibration_factor_default / adc_value);
+  unsigned int adc_value = moving_average(avg, readADC());
+#ifdef DEBUG
+  telemetry_calibration(adc_value);
+  telemetry_flush();
+#endif
+#ifdef OPTICAL
+  telemetry_calibration(adc_value);
+  optical_flush();
+#endif
+  blink_int(adc_to_vcc(calibration_factor_default, adc_value));
 
   // initialize Port B: configure all pins as INPUT to save power
   DDRB  = 0b00000000;
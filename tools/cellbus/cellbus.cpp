@@ -0,0 +1,127 @@
+//
+// HousePower MiniBMS Cell Module
+// OpenSource Replacement Firmware
+// Copyright 2021 Martin Bartosch
+//
+// See LICENSE file.
+//
+
+//////////////////////////////////////////////////////////////////////////
+// Cell bus reader
+// Starts a read of the daisy chained cell bus (see Cell bus in src/main.cpp)
+// by sending a break and prints the records of all modules.
+//
+// Example:
+//   ./cellbus -n 16 /dev/ttyUSB0
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <vector>
+
+#include <fcntl.h>
+#include <stdint.h>
+#include <termios.h>
+#include <unistd.h>
+
+const char *c_StateName[] = { "n/a", "OK", "LVC", "HVC" };
+
+// CRC8 Dallas/Maxim, same as _crc_ibutton_update() (avr-libc)
+static uint8_t crc_ibutton_update(uint8_t crc, uint8_t data) {
+  crc ^= data;
+  for (int ii = 0; ii < 8; ii++)
+    crc = (crc & 1) ? (crc >> 1) ^ 0x8c : (crc >> 1);
+  return crc;
+}
+
+static void usage() {
+  fprintf(stderr, "usage: cellbus [-n cells] [-t timeout] device\n"
+    "  -n cells    expected number of modules\n"
+    "  -t timeout  time to wait for records in 0.1 s (20)\n");
+}
+
+int main(int argc, char **argv) {
+  int cells = 0;
+  int timeout = 20;
+  int opt;
+  while ((opt = getopt(argc, argv, "n:t:")) != -1) {
+    switch (opt) {
+    case 'n':
+      cells = atoi(optarg);
+      break;
+    case 't':
+      timeout = atoi(optarg);
+      break;
+    default:
+      usage();
+      return 1;
+    }
+  }
+  if (optind != argc - 1 || timeout < 1 || timeout > 255) {
+    usage();
+    return 1;
+  }
+
+  const char *device = argv[optind];
+  int fd = open(device, O_RDWR | O_NOCTTY);
+  if (fd < 0) {
+    perror(device);
+    return 1;
+  }
+
+  // 2400 Baud 8N1, raw, read returns after the line has been quiet for the timeout
+  struct termios tio;
+  if (tcgetattr(fd, &tio) < 0) {
+    perror(device);
+    return 1;
+  }
+  cfmakeraw(&tio);
+  cfsetispeed(&tio, B2400);
+  cfsetospeed(&tio, B2400);
+  tio.c_cflag |= CLOCAL | CREAD;
+  tio.c_cc[VMIN] = 0;
+  tio.c_cc[VTIME] = timeout;
+  tcsetattr(fd, TCSANOW, &tio);
+  tcflush(fd, TCIOFLUSH);
+
+  // start read
+  tcsendbreak(fd, 0);
+
+  std::vector<uint8_t> data;
+  uint8_t buf[256];
+  ssize_t n;
+  while ((n = read(fd, buf, sizeof(buf))) > 0)
+    data.insert(data.end(), buf, buf + n);
+  close(fd);
+
+  // records: position, voltage (16 bit), status, crc; breaks show up as
+  // zero bytes in between
+  int found = 0;
+  int expected = 1;
+  for (size_t ii = 0; ii + 5 <= data.size(); ii++) {
+    const uint8_t *r = &data[ii];
+    uint8_t crc = 0;
+    for (int kk = 0; kk < 4; kk++)
+      crc = crc_ibutton_update(crc, r[kk]);
+    if ((crc != r[4]) || (r[0] == 0))
+      continue;
+
+    if (r[0] != expected)
+      printf("missing records %d - %d\n", expected, r[0] - 1);
+    printf("%2u: %4u mV %-3s%s%s\n", r[0], r[1] | (r[2] << 8), c_StateName[r[3] & 0x03],
+      (r[3] & 0x04) ? " shunting" : "", (r[3] & 0x08) ? " (pending)" : "");
+    expected = r[0] + 1;
+    found++;
+    ii += 4;
+  }
+
+  if (cells && (found != cells)) {
+    fprintf(stderr, "%d of %d modules responded\n", found, cells);
+    return 2;
+  }
+  if (!found) {
+    fprintf(stderr, "no response\n");
+    return 2;
+  }
+  return 0;
+}
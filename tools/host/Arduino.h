@@ -0,0 +1,31 @@
+//
+// HousePower MiniBMS Cell Module
+// OpenSource Replacement Firmware
+// Copyright 2021 Martin Bartosch
+//
+// See LICENSE file.
+//
+
+//////////////////////////////////////////////////////////////////////////
+// Minimal host replacement for the Arduino core
+// Allows compiling the hardware independent parts of the firmware (see
+// src/cellstate.h) natively for the host tools. NOTE: int is 32 bits wide
+// on the host, the engine code must not depend on 16 bit overflow.
+
+#ifndef HOST_ARDUINO_H
+#define HOST_ARDUINO_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+typedef uint8_t byte;
+typedef bool boolean;
+
+// program memory is ordinary memory on the host
+#define PROGMEM
+#define pgm_read_byte(addr) (*(const uint8_t *) (addr))
+#define pgm_read_word(addr) (*(const uint16_t *) (addr))
+
+#define _BV(bit) (1 << (bit))
+
+#endif
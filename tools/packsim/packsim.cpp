@@ -0,0 +1,561 @@
+//
+// HousePower MiniBMS Cell Module
+// OpenSource Replacement Firmware
+// Copyright 2021 Martin Bartosch
+//
+// See LICENSE file.
+//
+
+//////////////////////////////////////////////////////////////////////////
+// Pack simulator
+// Simulates a pack of cells in series, each monitored by a cell module
+// running the firmware cell state engine (src/cellstate.h), against a shared
+// charge/discharge current profile and a model of the head-end (main board)
+// loop. Each module has its own calibration error, and each cell its own
+// capacity, internal resistance and initial state of charge (uniformly
+// distributed around the nominal values, reproducible with the seed).
+//
+// The simulation advances in fixed steps of one measurement cycle (1 s).
+// Within a step the modules are independent and run in parallel on the
+// worker threads, the head-end then evaluates the loop and sets the pack
+// current for the next step. The results do not depend on the number of
+// threads.
+//
+// Models:
+// - cell: LiFePO4 open circuit voltage curve, terminal voltage with the
+//   internal resistance, the module measures with the shunt off
+// - shunt: c_ShuntResistance, on for 1000 ms of each 1100 ms shunting and
+//   HVC cycle, with PWM the duty cycle of the firmware (SHUNT_PWM)
+// - loop: open while any module is in LVC or HVC state, the head-end stops
+//   the current while the loop is open and resumes the profile after a
+//   restart delay once the loop is closed again
+// - profile: cycles of charging and discharging with constant current
+//
+// Balancing modes (-m): stock (on/off shunt), pwm (SHUNT_PWM), predictive
+// (trend horizon) and pwm+predictive.
+//
+// Example:
+//   packsim -n 16 -m stock,pwm,predictive -k 5 -u 10
+
+#include <Arduino.h>
+#include "cellstate.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <random>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <getopt.h>
+
+// firmware configuration (see USER CONFIGURATION in src/main.cpp)
+const byte c_MovingAverageWindow = 5;
+const unsigned int c_MaxSample = 6000;
+const double c_ShuntResistance = 5.0;          // Ohm
+const byte c_ShuntPwmMinDuty = 25;
+// shunt on time per shunting and HVC cycle (1000 of 1100 ms)
+const double c_ShuntOnFraction = 1000.0 / 1100.0;
+
+// simulation step (s), one measurement cycle
+const double c_Step = 1;
+
+// LiFePO4 open circuit voltage (mV) over the state of charge (%)
+struct ocv_point {
+  double soc;
+  double mv;
+};
+const ocv_point c_Ocv[] = {
+  {   0, 2500 }, {   5, 3000 }, {  10, 3200 }, {  20, 3250 }, {  30, 3280 },
+  {  40, 3300 }, {  50, 3310 }, {  60, 3320 }, {  70, 3330 }, {  80, 3340 },
+  {  90, 3350 }, {  95, 3400 }, {  98, 3500 }, {  99, 3580 }, { 100, 3650 } };
+const unsigned int c_OcvPoints = sizeof(c_Ocv) / sizeof(c_Ocv[0]);
+// slope beyond full charge (mV per %)
+const double c_OcvOvercharge = 200;
+
+enum { m_Stock, m_Pwm, m_Predictive, m_PwmPredictive, m_TOTALMODES };
+const char *c_ModeName[] = { "stock", "pwm", "predictive", "pwm+predictive" };
+
+struct config {
+  unsigned int cells;
+  // nominal cell values and spread (+- %, uniform)
+  double capacity;         // Ah
+  double capacity_spread;
+  double resistance;       // mOhm
+  double resistance_spread;
+  double soc;              // initial state of charge (%)
+  double soc_spread;       // +- percentage points
+  double calibration_spread;  // module calibration error (+- %)
+  // profile
+  double charge_current;   // A
+  double charge_time;      // h
+  double discharge_current;  // A
+  double discharge_time;   // h
+  unsigned int cycles;
+  double restart_delay;    // s
+  // balanced: SOC spread (percentage points)
+  double balanced;
+  unsigned long seed;
+  unsigned int threads;
+  unsigned int chunk;      // minimum number of cells per thread (0: none)
+  bool verbose;
+  cell_params p;
+};
+
+struct cell_model {
+  double capacity;         // As
+  double resistance;       // Ohm
+  double charge;           // As
+  double calibration;      // gain of the module measurement
+};
+
+struct module {
+  cell_model cell;
+  cell_engine engine;
+  moving_average_t<c_MovingAverageWindow, c_MaxSample> avg;
+  // shunt on fraction of the current step
+  double shunt;
+  bool loop_open;
+  // statistics
+  double shunt_energy;     // J
+  double shunt_time;       // s
+  unsigned long hvc;
+  unsigned long lvc;
+};
+
+struct result {
+  double time_to_balance;  // s, < 0: not balanced
+  double spread_start;
+  double spread_end;
+  double charged;          // As into the pack
+  double discharged;       // As out of the pack
+  unsigned long openings;
+  unsigned long openings_hvc;
+  unsigned long openings_lvc;
+  unsigned long charge_cycles;
+  std::vector<module> modules;
+};
+
+//////////////////////////////////////////////////////////////////////////
+// Cell and module models
+
+static double ocv(double soc) {
+  if (soc <= c_Ocv[0].soc)
+    return c_Ocv[0].mv;
+  for (unsigned int ii = 1; ii < c_OcvPoints; ii++) {
+    if (soc <= c_Ocv[ii].soc) {
+      const ocv_point &a = c_Ocv[ii - 1];
+      const ocv_point &b = c_Ocv[ii];
+      return a.mv + (b.mv - a.mv) * (soc - a.soc) / (b.soc - a.soc);
+    }
+  }
+  return c_Ocv[c_OcvPoints - 1].mv + (soc - c_Ocv[c_OcvPoints - 1].soc) * c_OcvOvercharge;
+}
+
+static double soc_of(const cell_model &c) {
+  return 100.0 * c.charge / c.capacity;
+}
+
+// terminal voltage (mV) for the given cell current (A, charging positive)
+static double terminal_voltage(const cell_model &c, double current) {
+  return ocv(soc_of(c)) + current * c.resistance * 1000;
+}
+
+// measurement with the shunt off, rounded to the 1 mV resolution of the firmware
+static unsigned int measure(const cell_model &c, double current) {
+  double mv = terminal_voltage(c, current) * c.calibration;
+  if (mv < 0)
+    mv = 0;
+  if (mv > c_MaxSample)
+    mv = c_MaxSample;
+  return (unsigned int) (mv + 0.5);
+}
+
+static void module_init(module &m, const cell_params &p) {
+  memset(&m.avg, 0, sizeof(m.avg));
+  unsigned int mv = measure(m.cell, 0);
+  cell_init(m.engine, mv);
+  for (byte ii = 0; ii < c_MovingAverageWindow; ii++)
+    m.engine.cellvoltage = moving_average(m.avg, mv);
+  cell_boot(m.engine, p);
+  m.shunt = 0;
+  m.loop_open = false;
+  m.shunt_energy = 0;
+  m.shunt_time = 0;
+  m.hvc = 0;
+  m.lvc = 0;
+}
+
+// one measurement cycle with the pack current of this step: the cell is
+// charged/discharged (minus the shunt current of the previous decision),
+// then the module measures and runs the firmware main loop sequence
+static void module_step(module &m, const cell_params &p, int mode, double current) {
+  cell_model &c = m.cell;
+
+  // shunt on: V = OCV + (I - V / Rs) * R
+  double v_on = (ocv(soc_of(c)) / 1000 + current * c.resistance) / (1 + c.resistance / c_ShuntResistance);
+  double shunt_current = (v_on / c_ShuntResistance) * m.shunt;
+  c.charge += (current - shunt_current) * c_Step;
+  if (c.charge < 0)
+    c.charge = 0;
+  m.shunt_energy += v_on * shunt_current * c_Step;
+  m.shunt_time += m.shunt * c_Step;
+
+  const unsigned int raw = measure(c, current);
+  const byte prev_state = m.engine.cellstate;
+  cell_age(m.engine, (byte) c_Step);
+  m.engine.cellvoltage = moving_average(m.avg, raw);
+  if (cell_fast_trip(m.engine, p, raw))
+    m.engine.cellvoltage = moving_average_fill(m.avg, raw);
+  cell_trend(m.engine, (byte) c_Step);
+  determine_cellstate(m.engine, p, (byte) c_Step);
+  update_cutoff_age(m.engine, p);
+
+  if (m.engine.cellstate != prev_state) {
+    if (m.engine.cellstate == e_CellHVC)
+      m.hvc++;
+    else if (m.engine.cellstate == e_CellLVC)
+      m.lvc++;
+  }
+
+  // outputs of this cycle (see loop() in src/main.cpp)
+  m.loop_open = (m.engine.cellstate == e_CellLVC) || (m.engine.cellstate == e_CellHVC);
+  if (m.engine.cellstate == e_CellHVC) {
+    m.shunt = c_ShuntOnFraction;
+  } else if ((m.engine.cellstate == e_CellNorm) && m.engine.shunting) {
+    if ((mode == m_Pwm) || (mode == m_PwmPredictive))
+      m.shunt = cell_shunt_duty(m.engine, p, c_ShuntPwmMinDuty, p.hv_disengage) / 100.0;
+    else
+      m.shunt = c_ShuntOnFraction;
+  } else {
+    m.shunt = 0;
+  }
+}
+
+//////////////////////////////////////////////////////////////////////////
+// Parallel stepping
+// The workers own fixed slices of the modules. Each step is started by the
+// main thread (generation counter) and the workers report completion, the
+// threads spin (with yield) in between.
+
+struct stepper {
+  std::vector<module> *modules;
+  const cell_params *p;
+  int mode;
+  double current;
+  std::atomic<unsigned long> generation;
+  std::atomic<unsigned int> done;
+  std::atomic<bool> quit;
+};
+
+static void step_slice(stepper &s, unsigned int slice, unsigned int slices) {
+  std::vector<module> &m = *s.modules;
+  for (size_t ii = slice; ii < m.size(); ii += slices)
+    module_step(m[ii], *s.p, s.mode, s.current);
+}
+
+static void worker(stepper &s, unsigned int slice, unsigned int slices) {
+  unsigned long seen = 0;
+  for (;;) {
+    unsigned long g;
+    while ((g = s.generation.load()) == seen) {
+      if (s.quit.load())
+        return;
+      std::this_thread::yield();
+    }
+    seen = g;
+    step_slice(s, slice, slices);
+    s.done++;
+  }
+}
+
+//////////////////////////////////////////////////////////////////////////
+// Simulation
+
+static double soc_spread(const std::vector<module> &m) {
+  double lo = 1e9, hi = -1e9;
+  for (const module &mm : m) {
+    double soc = soc_of(mm.cell);
+    lo = std::min(lo, soc);
+    hi = std::max(hi, soc);
+  }
+  return hi - lo;
+}
+
+static void create_pack(const config &cfg, std::vector<module> &m) {
+  // the same pack for all modes
+  std::mt19937 rng(cfg.seed);
+  std::uniform_real_distribution<double> u(-1, 1);
+  m.resize(cfg.cells);
+  for (module &mm : m) {
+    cell_model &c = mm.cell;
+    c.capacity = cfg.capacity * (1 + cfg.capacity_spread / 100 * u(rng)) * 3600;
+    c.resistance = cfg.resistance * (1 + cfg.resistance_spread / 100 * u(rng)) / 1000;
+    double soc = cfg.soc + cfg.soc_spread * u(rng);
+    c.charge = c.capacity * std::max(0.0, soc) / 100;
+    c.calibration = 1 + cfg.calibration_spread / 100 * u(rng);
+  }
+}
+
+static void simulate(const config &cfg, int mode, result &r) {
+  cell_params p = cfg.p;
+  if ((mode == m_Stock) || (mode == m_Pwm))
+    p.trend_horizon = 0;
+
+  create_pack(cfg, r.modules);
+  for (module &m : r.modules)
+    module_init(m, p);
+
+  r.time_to_balance = -1;
+  r.spread_start = soc_spread(r.modules);
+  r.charged = 0;
+  r.discharged = 0;
+  r.openings = 0;
+  r.openings_hvc = 0;
+  r.openings_lvc = 0;
+  r.charge_cycles = 0;
+
+  unsigned int threads = std::max(1u, std::min(cfg.threads, cfg.cells));
+  stepper s;
+  s.modules = &r.modules;
+  s.p = &p;
+  s.mode = mode;
+  s.current = 0;
+  s.generation = 0;
+  s.done = 0;
+  s.quit = false;
+  // the main thread runs the first slice
+  std::vector<std::thread> pool;
+  for (unsigned int ii = 1; ii < threads; ii++)
+    pool.push_back(std::thread(worker, std::ref(s), ii, threads));
+
+  const unsigned long charge_steps = (unsigned long) (cfg.charge_time * 3600 / c_Step);
+  const unsigned long cycle_steps = charge_steps + (unsigned long) (cfg.discharge_time * 3600 / c_Step);
+  bool loop_open = false;
+  double restart = 0;      // time until the head-end resumes (s)
+
+  for (unsigned long step = 0; step < cfg.cycles * cycle_steps; step++) {
+    const unsigned long in_cycle = step % cycle_steps;
+    const bool charging = in_cycle < charge_steps;
+    if (in_cycle == 0)
+      r.charge_cycles++;
+
+    // head-end: no current while the loop is open or during the restart delay
+    double current = charging ? cfg.charge_current : -cfg.discharge_current;
+    if (loop_open || (restart > 0)) {
+      current = 0;
+      if (!loop_open)
+        restart -= c_Step;
+    }
+    if (current > 0)
+      r.charged += current * c_Step;
+    else
+      r.discharged -= current * c_Step;
+
+    s.current = current;
+    s.done = 0;
+    s.generation++;
+    step_slice(s, 0, threads);
+    while (s.done.load() != threads - 1)
+      std::this_thread::yield();
+
+    // loop of this step
+    bool open = false, hvc = false;
+    for (const module &m : r.modules) {
+      if (m.loop_open) {
+        open = true;
+        if (m.engine.cellstate == e_CellHVC)
+          hvc = true;
+      }
+    }
+    if (open && !loop_open) {
+      r.openings++;
+      if (hvc)
+        r.openings_hvc++;
+      else
+        r.openings_lvc++;
+    }
+    if (!open && loop_open)
+      restart = cfg.restart_delay;
+    loop_open = open;
+
+    if ((r.time_to_balance < 0) && (soc_spread(r.modules) <= cfg.balanced))
+      r.time_to_balance = (step + 1) * c_Step;
+  }
+
+  s.quit = true;
+  for (std::thread &t : pool)
+    t.join();
+  r.spread_end = soc_spread(r.modules);
+}
+
+//////////////////////////////////////////////////////////////////////////
+// Command line
+
+static bool parse_modes(const char *arg, std::vector<int> &modes) {
+  modes.clear();
+  std::stringstream ss(arg);
+  std::string item;
+  while (std::getline(ss, item, ',')) {
+    int mode = -1;
+    for (int ii = 0; ii < m_TOTALMODES; ii++)
+      if (item == c_ModeName[ii])
+        mode = ii;
+    if (mode < 0)
+      return false;
+    modes.push_back(mode);
+  }
+  return !modes.empty();
+}
+
+static void usage() {
+  fprintf(stderr,
+    "usage: packsim [options]\n"
+    "  -m mode,...  balancing modes: stock, pwm, predictive, pwm+predictive\n"
+    "               (stock,pwm,predictive)\n"
+    "  -n n         number of cells (16)\n"
+    "  -C Ah        nominal capacity (100)\n"
+    "  -k %%         capacity spread, +- (5)\n"
+    "  -R mOhm      nominal internal resistance (1.0)\n"
+    "  -r %%         internal resistance spread, +- (20)\n"
+    "  -s %%         initial state of charge (50)\n"
+    "  -u %%         initial state of charge spread, +- percentage points (5)\n"
+    "  -a %%         module calibration error, +- (0.3)\n"
+    "  -c A         charge current (10)\n"
+    "  -t h         charge time per cycle (8)\n"
+    "  -d A         discharge current (10)\n"
+    "  -T h         discharge time per cycle (4)\n"
+    "  -y n         number of cycles (10)\n"
+    "  -w s         head-end restart delay after the loop closes (60)\n"
+    "  -b %%         balanced: state of charge spread, percentage points (1)\n"
+    "  -p s         trend horizon of the predictive modes (512)\n"
+    "  -S seed      random seed of the pack (1)\n"
+    "  -j n         number of threads (number of cores, at most one per cell)\n"
+    "  -g n         at least n cells per thread (default threads only)\n"
+    "  -v           print the modules\n");
+}
+
+int main(int argc, char **argv) {
+  config cfg;
+  cfg.cells = 16;
+  cfg.capacity = 100;
+  cfg.capacity_spread = 5;
+  cfg.resistance = 1.0;
+  cfg.resistance_spread = 20;
+  cfg.soc = 50;
+  cfg.soc_spread = 5;
+  cfg.calibration_spread = 0.3;
+  cfg.charge_current = 10;
+  cfg.charge_time = 8;
+  cfg.discharge_current = 10;
+  cfg.discharge_time = 4;
+  cfg.cycles = 10;
+  cfg.restart_delay = 60;
+  cfg.balanced = 1;
+  cfg.seed = 1;
+  cfg.threads = 0;
+  cfg.chunk = 0;
+  cfg.verbose = false;
+
+  // firmware defaults (see USER CONFIGURATION in src/main.cpp)
+  cfg.p.lv_engage = 2900;
+  cfg.p.lv_disengage = 2950;
+  cfg.p.hv_engage = 3600;
+  cfg.p.hv_disengage = 3550;
+  cfg.p.shunt_engage = 3500;
+  cfg.p.shunt_disengage = 3450;
+  cfg.p.settle_time = 3;
+  cfg.p.recent_cutoff_duration = 30 * 60;
+  cfg.p.fast_trip_margin = 200;
+  cfg.p.trend_horizon = 512;
+
+  std::vector<int> modes = { m_Stock, m_Pwm, m_Predictive };
+
+  int opt;
+  while ((opt = getopt(argc, argv, "m:n:C:k:R:r:s:u:a:c:t:d:T:y:w:b:p:S:j:g:vh")) != -1) {
+    switch (opt) {
+    case 'm':
+      if (!parse_modes(optarg, modes)) {
+        usage();
+        return 1;
+      }
+      break;
+    case 'n': cfg.cells = atoi(optarg); break;
+    case 'C': cfg.capacity = atof(optarg); break;
+    case 'k': cfg.capacity_spread = atof(optarg); break;
+    case 'R': cfg.resistance = atof(optarg); break;
+    case 'r': cfg.resistance_spread = atof(optarg); break;
+    case 's': cfg.soc = atof(optarg); break;
+    case 'u': cfg.soc_spread = atof(optarg); break;
+    case 'a': cfg.calibration_spread = atof(optarg); break;
+    case 'c': cfg.charge_current = atof(optarg); break;
+    case 't': cfg.charge_time = atof(optarg); break;
+    case 'd': cfg.discharge_current = atof(optarg); break;
+    case 'T': cfg.discharge_time = atof(optarg); break;
+    case 'y': cfg.cycles = atoi(optarg); break;
+    case 'w': cfg.restart_delay = atof(optarg); break;
+    case 'b': cfg.balanced = atof(optarg); break;
+    case 'p': cfg.p.trend_horizon = atoi(optarg); break;
+    case 'S': cfg.seed = strtoul(optarg, NULL, 10); break;
+    case 'j': cfg.threads = atoi(optarg); break;
+    case 'g': cfg.chunk = atoi(optarg); break;
+    case 'v': cfg.verbose = true; break;
+    default:
+      usage();
+      return 1;
+    }
+  }
+  if ((optind < argc) || (cfg.cells < 1) || (cfg.capacity <= 0) || (cfg.cycles < 1) ||
+      (cfg.charge_time + cfg.discharge_time <= 0)) {
+    usage();
+    return 1;
+  }
+  if (cfg.threads < 1) {
+    cfg.threads = std::thread::hardware_concurrency();
+    if (cfg.chunk)
+      cfg.threads = std::min(cfg.threads, cfg.cells / cfg.chunk);
+    cfg.threads = std::max(1u, std::min(cfg.threads, cfg.cells));
+  }
+
+  printf("mode\tcells\tbalance_h\tspread_start\tspread_end\tshunt_Wh\tshunt_Wh_max"
+    "\tcharged_Ah\tdischarged_Ah\tcycles\topenings\thvc_openings\tlvc_openings\topenings/cycle\n");
+  for (int mode : modes) {
+    result r;
+    auto start = std::chrono::steady_clock::now();
+    simulate(cfg, mode, r);
+    double secs = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    double energy = 0, energy_max = 0;
+    for (const module &m : r.modules) {
+      energy += m.shunt_energy;
+      energy_max = std::max(energy_max, m.shunt_energy);
+    }
+    char balance[32] = "-";
+    if (r.time_to_balance >= 0)
+      snprintf(balance, sizeof(balance), "%.2f", r.time_to_balance / 3600);
+    printf("%s\t%u\t%s\t%.2f\t%.2f\t%.2f\t%.2f\t%.1f\t%.1f\t%lu\t%lu\t%lu\t%lu\t%.2f\n",
+      c_ModeName[mode], cfg.cells, balance, r.spread_start, r.spread_end,
+      energy / 3600, energy_max / 3600, r.charged / 3600, r.discharged / 3600,
+      r.charge_cycles, r.openings, r.openings_hvc, r.openings_lvc,
+      r.charge_cycles ? (double) r.openings / r.charge_cycles : 0.0);
+    if (cfg.verbose) {
+      printf("#\tmodule\tcapacity_Ah\tresistance_mOhm\tcalibration\tsoc\tshunt_Wh\tshunt_h\thvc\tlvc\n");
+      for (size_t ii = 0; ii < r.modules.size(); ii++) {
+        const module &m = r.modules[ii];
+        printf("#\t%zu\t%.1f\t%.2f\t%.4f\t%.2f\t%.2f\t%.2f\t%lu\t%lu\n",
+          ii, m.cell.capacity / 3600, m.cell.resistance * 1000, m.cell.calibration,
+          soc_of(m.cell), m.shunt_energy / 3600, m.shunt_time / 3600, m.hvc, m.lvc);
+      }
+    }
+    fflush(stdout);
+    fprintf(stderr, "%s: %u cells, %.0f h simulated in %.3f s\n", c_ModeName[mode], cfg.cells,
+      cfg.cycles * (cfg.charge_time + cfg.discharge_time), secs);
+  }
+  return 0;
+}
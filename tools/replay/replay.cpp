@@ -0,0 +1,434 @@
+//
+// HousePower MiniBMS Cell Module
+// OpenSource Replacement Firmware
+// Copyright 2021 Martin Bartosch
+//
+// See LICENSE file.
+//
+
+//////////////////////////////////////////////////////////////////////////
+// Trace replay harness
+// Replays recorded cell voltage traces through the firmware cell state
+// engine (src/cellstate.h) and reports state transitions, shunt duty and
+// time-to-trip for a grid of parameter sets. The parameter sets are
+// evaluated in parallel on all available cores.
+//
+// Trace formats:
+// - CSV/text: one sample per line, either "mV" or "t,mV" (t in s),
+//   empty lines and lines starting with '#' are ignored
+// - binary (file name ending in .bin): little endian uint16 samples (mV)
+// Samples without timestamps are spaced by the sample interval (-i).
+//
+// Example:
+//   replay -w 3,5,8 -s 1,3,5 -H 3500,3550 trace.csv
+
+#include <Arduino.h>
+#include "cellstate.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <getopt.h>
+
+// highest sample value (mV) accepted by the moving average, same limit as
+// used by the firmware outside of CALIBRATION_MODE
+const unsigned int c_MaxSample = 6000;
+// largest moving average window with a 16 bit running sum
+const unsigned int c_MaxWindow = 0xffff / c_MaxSample;
+
+struct trace {
+  std::string name;
+  // sample time (in s) and cell voltage (in mV)
+  std::vector<double> t;
+  std::vector<unsigned int> mv;
+};
+
+struct param_set {
+  byte window;
+  cell_params p;
+};
+
+struct result {
+  unsigned long samples;
+  double duration;
+  // number of committed transitions [from][to]
+  unsigned long transitions[e_TOTALCELLSTATES][e_TOTALCELLSTATES];
+  double state_time[e_TOTALCELLSTATES];
+  unsigned long shunt_events;
+  double shunt_time;
+  // committed LVC/HVC events and time from the first raw sample beyond the
+  // engage threshold until the cell state engine committed the cutoff
+  // (an excursion lasts until the raw voltage is back within the disengage
+  // threshold)
+  unsigned long trips;
+  // cutoffs forced by the fast trip path
+  unsigned long fast_trips;
+  unsigned long trip_delays;
+  double trip_delay_sum;
+  double trip_delay_max;
+  // excursions beyond the engage thresholds filtered out by the engine
+  // (not committed as cutoff)
+  unsigned long missed_trips;
+};
+
+struct job {
+  const trace *tr;
+  const param_set *ps;
+  result res;
+};
+
+//////////////////////////////////////////////////////////////////////////
+// Trace input
+
+static bool ends_with(const std::string &s, const char *suffix) {
+  size_t n = strlen(suffix);
+  return s.size() >= n && s.compare(s.size() - n, n, suffix) == 0;
+}
+
+static bool load_binary(trace &tr, const char *path, double interval) {
+  std::ifstream in(path, std::ios::binary);
+  if (!in)
+    return false;
+  unsigned char buf[2];
+  while (in.read((char *) buf, 2)) {
+    tr.t.push_back(tr.mv.size() * interval);
+    tr.mv.push_back(buf[0] | (buf[1] << 8));
+  }
+  return true;
+}
+
+static bool load_csv(trace &tr, const char *path, double interval) {
+  std::ifstream in(path);
+  if (!in)
+    return false;
+  std::string line;
+  unsigned long lineno = 0;
+  while (std::getline(in, line)) {
+    lineno++;
+    size_t pos = line.find_first_not_of(" \t\r");
+    if (pos == std::string::npos || line[pos] == '#')
+      continue;
+
+    double t, mv;
+    std::replace(line.begin(), line.end(), ';', ',');
+    if (sscanf(line.c_str(), "%lf,%lf", &t, &mv) == 2) {
+      tr.t.push_back(t);
+    } else if (sscanf(line.c_str(), "%lf", &mv) == 1) {
+      tr.t.push_back(tr.mv.size() * interval);
+    } else {
+      // tolerate a header line
+      if (tr.mv.empty())
+        continue;
+      fprintf(stderr, "%s:%lu: invalid sample\n", path, lineno);
+      return false;
+    }
+    if (mv < 0 || mv > c_MaxSample) {
+      fprintf(stderr, "%s:%lu: sample out of range\n", path, lineno);
+      return false;
+    }
+    tr.mv.push_back((unsigned int) (mv + 0.5));
+  }
+  return true;
+}
+
+//////////////////////////////////////////////////////////////////////////
+// Replay
+
+// run one trace through the cell state engine, the firmware main loop
+// performs the same sequence of calls once per measurement cycle
+template <byte N>
+static void replay(const trace &tr, const cell_params &p, result &r) {
+  memset(&r, 0, sizeof(r));
+  r.samples = tr.mv.size();
+  if (tr.mv.empty())
+    return;
+  r.duration = tr.t.back() - tr.t.front();
+
+  // fast boot: the firmware seeds the filter with a burst of measurements
+  // and commits the initial state, modelled with the first sample
+  moving_average_t<N, c_MaxSample> avg;
+  memset(&avg, 0, sizeof(avg));
+  cell_engine cell;
+  cell_init(cell, tr.mv[0]);
+  for (byte ii = 0; ii < N; ii++)
+    cell.cellvoltage = moving_average(avg, tr.mv[0]);
+  cell_boot(cell, p);
+
+  // start of the current raw excursion beyond the LVC/HVC engage threshold
+  bool excursion = false;
+  bool excursion_tripped = false;
+  double excursion_start = 0;
+
+  double elapsed_carry = 0;
+  for (size_t ii = 0; ii < tr.mv.size(); ii++) {
+    const double now = tr.t[ii];
+    const double dt = (ii > 0) ? now - tr.t[ii - 1] : 0;
+
+    // the engine counts age in whole seconds, the fraction is carried over
+    // (firmware time_elapsed() on the calibrated time_ms base), the first
+    // sample is not aged (the boot state is committed without age)
+    elapsed_carry += dt;
+    double whole = elapsed_carry < 255 ? (double) (unsigned long) elapsed_carry : 255;
+    byte elapsed = (byte) whole;
+    elapsed_carry -= whole;
+
+    const byte prev_state = cell.cellstate;
+    const bool prev_shunting = cell.shunting;
+
+    r.state_time[prev_state] += dt;
+    if (prev_shunting)
+      r.shunt_time += dt;
+
+    const unsigned int raw = tr.mv[ii];
+    const bool beyond = (raw <= p.lv_engage) || (raw >= p.hv_engage);
+    const bool within = (raw > p.lv_disengage) && (raw < p.hv_disengage);
+    if (beyond && !excursion) {
+      excursion = true;
+      excursion_tripped = false;
+      excursion_start = now;
+    } else if (within && excursion) {
+      excursion = false;
+      if (!excursion_tripped)
+        r.missed_trips++;
+    }
+
+    cell_age(cell, elapsed);
+    cell.cellvoltage = moving_average(avg, raw);
+    if (cell_fast_trip(cell, p, raw)) {
+      cell.cellvoltage = moving_average_fill(avg, raw);
+      r.fast_trips++;
+    }
+    cell_trend(cell, elapsed);
+    determine_cellstate(cell, p, elapsed);
+    update_cutoff_age(cell, p);
+
+    if (cell.cellstate != prev_state) {
+      r.transitions[prev_state][cell.cellstate]++;
+      if ((cell.cellstate == e_CellLVC) || (cell.cellstate == e_CellHVC)) {
+        r.trips++;
+        if (excursion && !excursion_tripped) {
+          double delay = now - excursion_start;
+          r.trip_delays++;
+          r.trip_delay_sum += delay;
+          if (delay > r.trip_delay_max)
+            r.trip_delay_max = delay;
+        }
+      }
+    }
+    if ((cell.cellstate == e_CellLVC) || (cell.cellstate == e_CellHVC))
+      excursion_tripped = true;
+    if (cell.shunting && !prev_shunting)
+      r.shunt_events++;
+  }
+  if (excursion && !excursion_tripped)
+    r.missed_trips++;
+}
+
+// dispatch the runtime window size to the matching filter instance
+template <byte N>
+static void replay_window(byte window, const trace &tr, const cell_params &p, result &r) {
+  if (window == N)
+    replay<N>(tr, p, r);
+  else
+    replay_window<N - 1>(window, tr, p, r);
+}
+
+template <>
+void replay_window<0>(byte, const trace &, const cell_params &, result &) {
+}
+
+static void worker(std::vector<job> &jobs, std::atomic<size_t> &next) {
+  for (size_t ii = next++; ii < jobs.size(); ii = next++) {
+    job &j = jobs[ii];
+    replay_window<c_MaxWindow>(j.ps->window, *j.tr, j.ps->p, j.res);
+  }
+}
+
+//////////////////////////////////////////////////////////////////////////
+// Command line
+
+static bool parse_list(const char *arg, std::vector<unsigned int> &list) {
+  list.clear();
+  std::stringstream ss(arg);
+  std::string item;
+  while (std::getline(ss, item, ',')) {
+    char *end;
+    unsigned long val = strtoul(item.c_str(), &end, 10);
+    if (item.empty() || *end || val > 0xffff)
+      return false;
+    list.push_back(val);
+  }
+  return !list.empty();
+}
+
+static void usage() {
+  fprintf(stderr,
+    "usage: replay [options] trace...\n"
+    "  -i s         sample interval in s for traces without timestamps (1)\n"
+    "  -j n         number of worker threads (all cores)\n"
+    "parameter lists (comma separated, all combinations are evaluated):\n"
+    "  -w n,...     moving average window (1 - %u, 5)\n"
+    "  -s s,...     state settle time in s (3)\n"
+    "  -r s,...     recent cutoff duration in s (1800)\n"
+    "  -l mV,...    LVC engage voltage (2900)\n"
+    "  -L mV,...    LVC disengage voltage (2950)\n"
+    "  -h mV,...    HVC engage voltage (3600)\n"
+    "  -H mV,...    HVC disengage voltage (3550)\n"
+    "  -e mV,...    shunting engage voltage (3500)\n"
+    "  -d mV,...    shunting disengage voltage (3450)\n"
+    "  -f mV,...    fast trip margin, 0 disables (200)\n"
+    "  -p s,...     trend horizon for predictive balancing, 0 disables (512)\n",
+    c_MaxWindow);
+}
+
+int main(int argc, char **argv) {
+  double interval = 1;
+  unsigned int threads = std::thread::hardware_concurrency();
+
+  // parameter grid, defaults match the firmware configuration
+  enum { p_Window, p_Settle, p_Recent, p_LvEngage, p_LvDisengage,
+    p_HvEngage, p_HvDisengage, p_ShuntEngage, p_ShuntDisengage, p_FastTrip, p_TrendHorizon, p_TOTAL };
+  std::vector<unsigned int> grid[p_TOTAL] = {
+    { 5 }, { 3 }, { 30 * 60 }, { 2900 }, { 2950 }, { 3600 }, { 3550 }, { 3500 }, { 3450 }, { 200 }, { 512 } };
+  const char options[] = "w:s:r:l:L:h:H:e:d:f:p:";
+
+  int opt;
+  while ((opt = getopt(argc, argv, "i:j:w:s:r:l:L:h:H:e:d:f:p:")) != -1) {
+    switch (opt) {
+    case 'i':
+      interval = atof(optarg);
+      if (interval <= 0) {
+        usage();
+        return 1;
+      }
+      break;
+    case 'j':
+      threads = atoi(optarg);
+      break;
+    default: {
+      // parameter lists, options are ordered like the grid dimensions
+      const char *o = strchr(options, opt);
+      if (!o || opt == ':' || !parse_list(optarg, grid[(o - options) / 2])) {
+        usage();
+        return 1;
+      }
+    }
+    }
+  }
+  if (optind >= argc) {
+    usage();
+    return 1;
+  }
+  if (threads < 1)
+    threads = 1;
+
+  for (unsigned int w : grid[p_Window]) {
+    if (w < 1 || w > c_MaxWindow) {
+      fprintf(stderr, "moving average window must be within 1 - %u\n", c_MaxWindow);
+      return 1;
+    }
+  }
+
+  std::vector<trace> traces(argc - optind);
+  for (size_t ii = 0; ii < traces.size(); ii++) {
+    const char *path = argv[optind + ii];
+    trace &tr = traces[ii];
+    tr.name = path;
+    bool ok = ends_with(tr.name, ".bin") ? load_binary(tr, path, interval) : load_csv(tr, path, interval);
+    if (!ok) {
+      fprintf(stderr, "could not read trace %s\n", path);
+      return 1;
+    }
+  }
+
+  // expand the parameter grid
+  std::vector<param_set> sets(1);
+  for (int kk = 0; kk < p_TOTAL; kk++) {
+    std::vector<param_set> expanded;
+    for (const param_set &ps : sets) {
+      for (unsigned int val : grid[kk]) {
+        param_set n = ps;
+        switch (kk) {
+        case p_Window:         n.window = val; break;
+        case p_Settle:         n.p.settle_time = val; break;
+        case p_Recent:         n.p.recent_cutoff_duration = val; break;
+        case p_LvEngage:       n.p.lv_engage = val; break;
+        case p_LvDisengage:    n.p.lv_disengage = val; break;
+        case p_HvEngage:       n.p.hv_engage = val; break;
+        case p_HvDisengage:    n.p.hv_disengage = val; break;
+        case p_ShuntEngage:    n.p.shunt_engage = val; break;
+        case p_ShuntDisengage: n.p.shunt_disengage = val; break;
+        case p_FastTrip:       n.p.fast_trip_margin = val; break;
+        case p_TrendHorizon:   n.p.trend_horizon = val; break;
+        }
+        expanded.push_back(n);
+      }
+    }
+    sets.swap(expanded);
+  }
+
+  // the firmware rejects invalid thresholds at compile time, skip them here
+  std::vector<param_set> valid;
+  for (const param_set &ps : sets) {
+    const cell_params &p = ps.p;
+    if (cell_thresholds_valid(p.lv_engage, p.lv_disengage, p.hv_engage, p.hv_disengage,
+        p.shunt_engage, p.shunt_disengage))
+      valid.push_back(ps);
+  }
+  if (valid.size() != sets.size())
+    fprintf(stderr, "skipping %zu parameter sets with invalid thresholds\n", sets.size() - valid.size());
+  sets.swap(valid);
+
+  std::vector<job> jobs;
+  unsigned long total_samples = 0;
+  for (const trace &tr : traces) {
+    for (const param_set &ps : sets) {
+      job j = { &tr, &ps, result() };
+      jobs.push_back(j);
+      total_samples += tr.mv.size();
+    }
+  }
+
+  auto start = std::chrono::steady_clock::now();
+  std::atomic<size_t> next(0);
+  std::vector<std::thread> pool;
+  for (unsigned int ii = 0; ii < threads; ii++)
+    pool.push_back(std::thread(worker, std::ref(jobs), std::ref(next)));
+  for (std::thread &t : pool)
+    t.join();
+  double secs = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+  printf("trace\twindow\tsettle\trecent\tlvc\tlvc_off\thvc\thvc_off\tshunt\tshunt_off\tfast\thorizon"
+    "\ttransitions\tok>lvc\tlvc>ok\tok>hvc\thvc>ok\tshunt_events\tshunt_duty"
+    "\ttrips\tfast_trips\tmissed\ttrip_mean\ttrip_max\n");
+  for (const job &j : jobs) {
+    const result &r = j.res;
+    const cell_params &p = j.ps->p;
+    unsigned long transitions = 0;
+    for (int from = 0; from < e_TOTALCELLSTATES; from++)
+      for (int to = 0; to < e_TOTALCELLSTATES; to++)
+        transitions += r.transitions[from][to];
+    printf("%s\t%u\t%u\t%u\t%u\t%u\t%u\t%u\t%u\t%u\t%u\t%u\t%lu\t%lu\t%lu\t%lu\t%lu\t%lu\t%.4f\t%lu\t%lu\t%lu\t%.1f\t%.1f\n",
+      j.tr->name.c_str(), j.ps->window, p.settle_time, p.recent_cutoff_duration,
+      p.lv_engage, p.lv_disengage, p.hv_engage, p.hv_disengage, p.shunt_engage, p.shunt_disengage,
+      p.fast_trip_margin, p.trend_horizon, transitions,
+      r.transitions[e_CellNorm][e_CellLVC], r.transitions[e_CellLVC][e_CellNorm],
+      r.transitions[e_CellNorm][e_CellHVC], r.transitions[e_CellHVC][e_CellNorm],
+      r.shunt_events, r.duration > 0 ? r.shunt_time / r.duration : 0.0,
+      r.trips, r.fast_trips, r.missed_trips,
+      r.trip_delays ? r.trip_delay_sum / r.trip_delays : 0.0, r.trip_delay_max);
+  }
+
+  fprintf(stderr, "%zu parameter sets, %zu traces, %lu samples in %.3f s (%.1f Msamples/s, %u threads)\n",
+    sets.size(), traces.size(), total_samples, secs, secs > 0 ? total_samples / secs / 1e6 : 0.0, threads);
+  return 0;
+}
@@ -0,0 +1,292 @@
+//
+// HousePower MiniBMS Cell Module
+// OpenSource Replacement Firmware
+// Copyright 2021 Martin Bartosch
+//
+// See LICENSE file.
+//
+
+//////////////////////////////////////////////////////////////////////////
+// Energy benchmark
+// Runs firmware images (ELF) under simavr with a constant cell voltage for
+// each scenario and accounts every simulated CPU cycle: awake cycles, sleep
+// mode residency, on time of the ADC, timers and USI and the duty cycle of
+// the LED, loop and shunt outputs. The residency is turned into an estimated
+// supply current of the ATtiny using typical datasheet figures (see below).
+// The output is one line per image and scenario with the values per
+// simulated second, diff the output between commits to see the effect of a
+// firmware change on the energy budget.
+//
+// The simulated cell voltage is the supply voltage of the ATtiny, the
+// firmware measures it through the bandgap (ADC model of simavr).
+//
+// Example (PlatformIO images carry no MCU information, see Makefile):
+//   ./simbench -m attiny85 -f 1000000 ../../.pio/build/attiny85/firmware.elf
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+#include <getopt.h>
+
+#include <simavr/sim_avr.h>
+#include <simavr/sim_elf.h>
+
+// I/O registers (data space addresses, identical on the ATtiny25/45/85)
+const unsigned int c_RegADCSRA = 0x26;
+const unsigned int c_RegPORTB  = 0x38;
+const unsigned int c_RegPRR    = 0x40;
+const unsigned int c_RegMCUCR  = 0x55;
+
+// register bits
+const uint8_t c_ADEN   = 1 << 7;  // ADCSRA
+const uint8_t c_PRADC  = 1 << 0;  // PRR
+const uint8_t c_PRUSI  = 1 << 1;
+const uint8_t c_PRTIM0 = 1 << 2;
+const uint8_t c_PRTIM1 = 1 << 3;
+const uint8_t c_SM     = 3 << 3;  // MCUCR sleep mode SM1:SM0
+
+// outputs (see Pin definitions in src/main.cpp)
+const uint8_t c_PinLed   = 1 << 1;
+const uint8_t c_PinLoop  = 1 << 3;
+const uint8_t c_PinShunt = 1 << 4;
+
+// Typical supply current (uA) at 1 MHz and Vcc = 3 V, ATtiny25/45/85
+// datasheet (typical characteristics and power reduction register table).
+// Estimates only, good for comparing firmware versions. BOD current is not
+// included (fuse setting).
+const double c_ActiveCurrent    = 500;
+const double c_IdleCurrent      = 150;
+const double c_AdcNrCurrent     = 130;
+const double c_PowerDownCurrent = 4;    // watchdog running
+// additional current of the clocked modules (PRR bit cleared, not in power down)
+const double c_Timer0Current    = 4;
+const double c_Timer1Current    = 45;
+const double c_UsiCurrent       = 5;
+const double c_AdcClockCurrent  = 18;
+// additional current of the enabled ADC (ADEN) including the bandgap
+const double c_AdcCurrent       = 230;
+
+enum { e_Active = 0, e_Idle, e_AdcNr, e_PowerDown, e_TOTALMODES };
+
+struct scenario {
+  const char *name;
+  unsigned int vcc;       // cell voltage (mV)
+  double warmup;          // time (s) from power up until the measurement starts
+  double duration;        // measurement time (s)
+};
+
+// the firmware defaults (see USER CONFIGURATION in src/main.cpp): the normal
+// state shows the inverted LED pattern for c_RecentCutOffDuration after boot
+const scenario c_Scenarios[] = {
+  { "boot",           3300,    0,   2 },
+  // boot in the LVC hysteresis band (invalid state resolves to normal) and
+  // below LVC (loop stays open, no optical readout)
+  { "boot_low",       2920,    0,   2 },
+  { "boot_lvc",       2800,    0,   2 },
+  { "norm_recent",    3300,    5,  64 },
+  { "norm",           3300, 1860,  64 },
+  { "shunting",       3520,    5,  64 },
+  { "hvc",            3650,    5,  64 },
+  { "lvc",            2800,    5,  64 } };
+const unsigned int c_TotalScenarios = sizeof(c_Scenarios) / sizeof(c_Scenarios[0]);
+
+struct result {
+  avr_cycle_count_t cycles;
+  avr_cycle_count_t mode[e_TOTALMODES];
+  avr_cycle_count_t adc, timer0, timer1, usi;
+  avr_cycle_count_t led, loop, shunt;
+  // accumulated current (uA * cycles)
+  double charge;
+};
+
+// register state that determines how a period of cycles is spent
+struct io_state {
+  int mode;
+  uint8_t prr, port, adcsra;
+};
+
+// sleep mode selected by the firmware (entered by the SLEEP instruction)
+static int selected_sleep_mode(avr_t *avr) {
+  switch ((avr->data[c_RegMCUCR] & c_SM) >> 3) {
+  case 0:  return e_Idle;
+  case 1:  return e_AdcNr;
+  default: return e_PowerDown;
+  }
+}
+
+// register state before a step, a sleeping CPU is in the selected sleep mode
+static io_state sample(avr_t *avr) {
+  io_state s;
+  s.mode = (avr->state == cpu_Sleeping) ? selected_sleep_mode(avr) : e_Active;
+  s.prr = avr->data[c_RegPRR];
+  s.port = avr->data[c_RegPORTB];
+  s.adcsra = avr->data[c_RegADCSRA];
+  return s;
+}
+
+// account a period of the given length with the register state at its start
+static void account(const io_state &s, avr_cycle_count_t cycles, result &r) {
+  const int mode = s.mode;
+  const uint8_t prr = s.prr;
+  const uint8_t port = s.port;
+  const bool clocked = (mode != e_PowerDown);
+  double current = (mode == e_Active) ? c_ActiveCurrent :
+    (mode == e_Idle) ? c_IdleCurrent :
+    (mode == e_AdcNr) ? c_AdcNrCurrent : c_PowerDownCurrent;
+
+  r.cycles += cycles;
+  r.mode[mode] += cycles;
+  if (s.adcsra & c_ADEN) {
+    r.adc += cycles;
+    current += c_AdcCurrent;
+  }
+  if (clocked) {
+    if (!(prr & c_PRTIM0)) {
+      r.timer0 += cycles;
+      current += c_Timer0Current;
+    }
+    if (!(prr & c_PRTIM1)) {
+      r.timer1 += cycles;
+      current += c_Timer1Current;
+    }
+    if (!(prr & c_PRUSI)) {
+      r.usi += cycles;
+      current += c_UsiCurrent;
+    }
+    if (!(prr & c_PRADC))
+      current += c_AdcClockCurrent;
+  }
+  if (port & c_PinLed)
+    r.led += cycles;
+  if (port & c_PinLoop)
+    r.loop += cycles;
+  if (port & c_PinShunt)
+    r.shunt += cycles;
+  r.charge += current * cycles;
+}
+
+// run one scenario from power up, returns false if the simulation failed
+static bool run(const char *path, const char *mmcu, uint32_t frequency,
+    const scenario &sc, result &r) {
+  elf_firmware_t fw;
+  memset(&fw, 0, sizeof(fw));
+  if (elf_read_firmware(path, &fw) != 0) {
+    fprintf(stderr, "%s: could not read firmware\n", path);
+    return false;
+  }
+  if (mmcu)
+    strncpy(fw.mmcu, mmcu, sizeof(fw.mmcu) - 1);
+  if (frequency)
+    fw.frequency = frequency;
+  if (!fw.mmcu[0] || !fw.frequency) {
+    fprintf(stderr, "%s: MCU type and frequency unknown, use -m and -f\n", path);
+    return false;
+  }
+
+  avr_t *avr = avr_make_mcu_by_name(fw.mmcu);
+  if (!avr) {
+    fprintf(stderr, "%s: unknown MCU %s\n", path, fw.mmcu);
+    return false;
+  }
+  avr_init(avr);
+  avr_load_firmware(avr, &fw);
+  avr->vcc = sc.vcc;
+  avr->avcc = sc.vcc;
+  avr->log = LOG_ERROR;
+
+  const avr_cycle_count_t start = avr->cycle + (avr_cycle_count_t) (sc.warmup * fw.frequency);
+  const avr_cycle_count_t end = start + (avr_cycle_count_t) (sc.duration * fw.frequency);
+
+  memset(&r, 0, sizeof(r));
+  bool ok = true;
+  while (avr->cycle < end) {
+    // the state before the step (sleep mode, clocked modules, pins) determines
+    // how the elapsed cycles are spent, a sleeping CPU is advanced to the next
+    // timer event by simavr
+    const io_state state_before = sample(avr);
+    const avr_cycle_count_t before = avr->cycle;
+    const int state = avr_run(avr);
+    if ((state == cpu_Done) || (state == cpu_Crashed)) {
+      fprintf(stderr, "%s: simulation stopped in scenario %s\n", path, sc.name);
+      ok = false;
+      break;
+    }
+    if (avr->cycle > start) {
+      avr_cycle_count_t from = (before > start) ? before : start;
+      avr_cycle_count_t to = (avr->cycle < end) ? avr->cycle : end;
+      account(state_before, to - from, r);
+    }
+  }
+
+  avr_terminate(avr);
+  return ok;
+}
+
+static void usage() {
+  fprintf(stderr,
+    "usage: simbench [options] firmware.elf...\n"
+    "  -m mcu       MCU type (attiny45, attiny85, default: from the ELF file)\n"
+    "  -f hz        CPU frequency (default: from the ELF file)\n"
+    "  -s name      run only the given scenario (");
+  for (unsigned int ii = 0; ii < c_TotalScenarios; ii++)
+    fprintf(stderr, "%s%s", ii ? ", " : "", c_Scenarios[ii].name);
+  fprintf(stderr, ")\n");
+}
+
+static double percent(avr_cycle_count_t part, avr_cycle_count_t total) {
+  return total ? 100.0 * part / total : 0.0;
+}
+
+int main(int argc, char **argv) {
+  const char *mmcu = NULL;
+  uint32_t frequency = 0;
+  const char *only = NULL;
+
+  int opt;
+  while ((opt = getopt(argc, argv, "m:f:s:")) != -1) {
+    switch (opt) {
+    case 'm':
+      mmcu = optarg;
+      break;
+    case 'f':
+      frequency = strtoul(optarg, NULL, 10);
+      break;
+    case 's':
+      only = optarg;
+      break;
+    default:
+      usage();
+      return 1;
+    }
+  }
+  if (optind >= argc) {
+    usage();
+    return 1;
+  }
+
+  printf("image\tscenario\tvcc\tawake_cyc/s\tactive%%\tidle%%\tadc_nr%%\tpdown%%"
+    "\tadc%%\ttimer0%%\ttimer1%%\tusi%%\tled%%\tloop%%\tshunt%%\test_uA\n");
+  int status = 0;
+  for (int ii = optind; ii < argc; ii++) {
+    for (unsigned int jj = 0; jj < c_TotalScenarios; jj++) {
+      const scenario &sc = c_Scenarios[jj];
+      if (only && strcmp(only, sc.name))
+        continue;
+      result r;
+      if (!run(argv[ii], mmcu, frequency, sc, r)) {
+        status = 1;
+        continue;
+      }
+      printf("%s\t%s\t%u\t%.0f\t%.3f\t%.3f\t%.3f\t%.3f\t%.3f\t%.3f\t%.3f\t%.3f\t%.2f\t%.2f\t%.2f\t%.2f\n",
+        argv[ii], sc.name, sc.vcc, r.mode[e_Active] / sc.duration,
+        percent(r.mode[e_Active], r.cycles), percent(r.mode[e_Idle], r.cycles),
+        percent(r.mode[e_AdcNr], r.cycles), percent(r.mode[e_PowerDown], r.cycles),
+        percent(r.adc, r.cycles), percent(r.timer0, r.cycles), percent(r.timer1, r.cycles),
+        percent(r.usi, r.cycles), percent(r.led, r.cycles), percent(r.loop, r.cycles),
+        percent(r.shunt, r.cycles), r.cycles ? r.charge / r.cycles : 0.0);
+      fflush(stdout);
+    }
+  }
+  return status;
+}
@@ -0,0 +1,328 @@
+//
+// HousePower MiniBMS Cell Module
+// OpenSource Replacement Firmware
+// Copyright 2021 Martin Bartosch
+//
+// See LICENSE file.
+//
+
+//////////////////////////////////////////////////////////////////////////
+// Telemetry decoder
+// Decodes the binary telemetry frames sent by the firmware in DEBUG mode
+// (see Telemetry in src/main.cpp) and prints one line per frame.
+//
+// Example (serial adapter attached to PB1/Pin 6):
+//   stty -F /dev/ttyUSB0 9600 raw
+//   ./telemetry /dev/ttyUSB0
+//
+// The optical readout (OPTICAL) is Manchester coded, the input is then a
+// sampled phototransistor signal with one byte per sample (e.g. the binary
+// output of sigrok-cli), -m gives the sample rate:
+//   sigrok-cli -d fx2lafw -c samplerate=20k -C D0 --continuous -O binary | ./telemetry -m 20000
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+#include <getopt.h>
+
+#include <stdint.h>
+
+#define TELEMETRY_SYNC 0xa5
+
+// frame types
+enum {
+  e_FrameBoot = 1,
+  e_FrameStatus,
+  e_FrameShunt,
+  e_FrameProfile,
+  e_FrameCalibration,
+  e_FrameTemperature,
+  e_FrameLog,
+  e_FrameCapture,
+  e_FrameStatistics };
+
+// capture delta marking a gap in the sampling
+const int8_t c_CaptureGap = -128;
+
+// calibration factor of the last boot frame (raw ADC value to mV), 0: unknown
+static unsigned long calibration_factor = 0;
+
+// event log record types (cell state transitions use the new cell state)
+const char *c_LogEventName[] = { "boot", "OK", "LVC", "HVC", "extremes" };
+const unsigned int c_LogEvents = sizeof(c_LogEventName) / sizeof(c_LogEventName[0]);
+
+const char *c_StateName[] = { "n/a", "OK", "LVC", "HVC" };
+const unsigned int c_States = sizeof(c_StateName) / sizeof(c_StateName[0]);
+
+// CRC8 Dallas/Maxim, same as _crc_ibutton_update() (avr-libc)
+static uint8_t crc_ibutton_update(uint8_t crc, uint8_t data) {
+  crc ^= data;
+  for (int ii = 0; ii < 8; ii++)
+    crc = (crc & 1) ? (crc >> 1) ^ 0x8c : (crc >> 1);
+  return crc;
+}
+
+// little endian payload fields
+static unsigned int u16(const uint8_t *p) {
+  return p[0] | (p[1] << 8);
+}
+
+static unsigned long u32(const uint8_t *p) {
+  return u16(p) | ((unsigned long) u16(p + 2) << 16);
+}
+
+static const char *state_name(uint8_t state) {
+  return state < c_States ? c_StateName[state] : "?";
+}
+
+// print frame, returns false if the payload length does not match the type
+static bool print_frame(uint8_t type, const uint8_t *p, uint8_t length) {
+  switch (type) {
+  case e_FrameBoot:
+    if (length != 10)
+      return false;
+    printf("Boot%s: calibration factor default: %lu custom: %lu%s",
+      (p[8] & 1) ? " (calibration mode)" : "", u32(p), u32(p + 4),
+      (p[8] & 2) ? " (EEPROM)" : "");
+    if (p[9])
+      printf(" profile tick: %u us", p[9]);
+    printf("\n");
+    calibration_factor = u32(p + 4);
+    return true;
+  case e_FrameStatus:
+    if (length != 15)
+      return false;
+    printf("Vcc: %u (%u) [Cell curr: %s pend: %s age: %u] [Shunt curr: %u pend: %u age: %u] cutoffage: %u trend: %.2f mV/min\n",
+      u16(p), u16(p + 2), state_name(p[4]), state_name(p[5]), u16(p + 6),
+      p[8] & 1, (p[8] >> 1) & 1, u16(p + 9), u16(p + 11), (int16_t) u16(p + 13) * 60.0 / 256);
+    return true;
+  case e_FrameShunt:
+    if (length != 10)
+      return false;
+    printf("  [Ishunt: %u mA Pshunt: %u mW Rcell: %u mOhm Eshunt: %lu J]\n",
+      u16(p), u16(p + 2), u16(p + 4), u32(p + 6));
+    return true;
+  case e_FrameProfile:
+    if (length != 10 + 10 * c_States)
+      return false;
+    printf("  [Awake: %u adc: %lu state: %lu", u16(p), u32(p + 2), u32(p + 6));
+    for (unsigned int ii = 0; ii < c_States; ii++) {
+      const uint8_t *s = p + 10 + 10 * ii;
+      printf(" %s: %lu/%lu/%u", c_StateName[ii], u32(s), u32(s + 4), u16(s + 8));
+    }
+    printf("]\n");
+    return true;
+  case e_FrameCalibration:
+    if (length != 6)
+      return false;
+    printf("Vcc (uncalibrated): %u Vcc (calibrated): %u adc averaged value: %u\n",
+      u16(p + 2), u16(p + 4), u16(p));
+    return true;
+  case e_FrameTemperature:
+    if (length != 5)
+      return false;
+    printf("  [Temperature: %d C (adc %u)%s]\n",
+      (int16_t) u16(p), u16(p + 2), (p[4] & 1) ? " shunting inhibited" : "");
+    return true;
+  case e_FrameLog:
+    if (length != 13)
+      return false;
+    printf("Log %2u: #%3u %-8s uptime: %lu s Vcell: %u min: %u max: %u\n",
+      p[0], p[1], p[2] < c_LogEvents ? c_LogEventName[p[2]] : "?",
+      u32(p + 9), u16(p + 3), u16(p + 5), u16(p + 7));
+    return true;
+  case e_FrameStatistics: {
+    // band layout, scale, LVC/HVC entries, shunting time, time per state, bands
+    if ((length < 18 + 2) || ((length - 18) & 1))
+      return false;
+    unsigned int band_min = u16(p);
+    unsigned int width = 1u << p[2];
+    double unit = (double) (1ul << p[3]) / 3600;
+    printf("Statistics: LVC entries: %u HVC entries: %u shunting: %.1f h",
+      u16(p + 4) << p[3], u16(p + 6) << p[3], u16(p + 8) * unit);
+    for (unsigned int ii = 0; ii < c_States; ii++)
+      printf(" %s: %.1f h", c_StateName[ii], u16(p + 10 + 2 * ii) * unit);
+    printf("\n");
+    for (unsigned int ii = 0; ii < (length - 18u) / 2; ii++) {
+      unsigned int low = band_min + ii * width;
+      printf("  [%4u - %4u mV: %.1f h]\n", low, low + width - 1, u16(p + 18 + 2 * ii) * unit);
+    }
+    return true;
+  }
+  case e_FrameCapture: {
+    if ((length < 6) || (length != 6 + p[5]))
+      return false;
+    unsigned int rate = u16(p + 2);
+    printf("Capture: %u samples at %u Hz, trigger at #%u\n", p[5], rate, p[4]);
+    // samples before the trigger (time across a gap is unknown)
+    long sample = 0;
+    for (unsigned int ii = 0; ii < p[4]; ii++)
+      if ((int8_t) p[6 + ii] != c_CaptureGap)
+        sample--;
+    // one line per sample: position, time (ms) relative to the trigger, ADC value, Vcc (mV)
+    unsigned int adc = u16(p);
+    for (unsigned int ii = 0; ii < p[5]; ii++) {
+      int8_t delta = (int8_t) p[6 + ii];
+      if (delta == c_CaptureGap) {
+        printf("  #%-3u gap\n", ii);
+        continue;
+      }
+      adc += delta;
+      printf("  #%-3u %c %8.1f ms adc: %4u", ii, (ii == p[4]) ? '*' : ' ',
+        rate ? sample * 1000.0 / rate : 0.0, adc);
+      if (calibration_factor && adc)
+        printf(" Vcc: %lu", calibration_factor / adc);
+      printf("\n");
+      sample++;
+    }
+    return true;
+  }
+  }
+  printf("unknown frame type %u (%u bytes)\n", type, length);
+  return true;
+}
+
+// frame: sync, type, length, payload, crc
+static uint8_t frame[3 + 255 + 1];
+static unsigned int pos = 0;
+static unsigned long errors = 0;
+
+static void feed(uint8_t c) {
+  if ((pos == 0) && (c != TELEMETRY_SYNC))
+    return;
+  frame[pos++] = c;
+  if ((pos < 3) || (pos < 3u + frame[2] + 1))
+    return;
+
+  // complete frame
+  uint8_t crc = 0;
+  for (unsigned int ii = 1; ii < pos - 1; ii++)
+    crc = crc_ibutton_update(crc, frame[ii]);
+  if ((crc == frame[pos - 1]) && print_frame(frame[1], frame + 3, frame[2])) {
+    pos = 0;
+    return;
+  }
+
+  // resynchronize: drop the sync byte and parse the remaining bytes again
+  errors++;
+  fprintf(stderr, "invalid frame (%lu errors)\n", errors);
+  uint8_t rest[sizeof(frame)];
+  unsigned int count = pos - 1;
+  memcpy(rest, frame + 1, count);
+  pos = 0;
+  for (unsigned int ii = 0; ii < count; ii++)
+    feed(rest[ii]);
+}
+
+// Manchester demodulator (optical readout): a mid-bit edge follows the
+// previous one after a full bit, the edges in between (half a bit) are bit
+// boundaries. The first edge after the idle line (LED off) is the rising
+// mid-bit edge of the first preamble bit.
+struct manchester_rx {
+  double samples_per_bit;
+  unsigned long time;        // current sample
+  unsigned long edge;        // sample of the last mid-bit edge
+  int level;
+  bool sync;
+  unsigned int value;        // byte being received (LSB first)
+  unsigned int bits;
+};
+
+static void manchester_bit(manchester_rx &rx, int bit) {
+  rx.value |= bit << rx.bits;
+  if (++rx.bits == 8) {
+    feed(rx.value);
+    rx.value = 0;
+    rx.bits = 0;
+  }
+}
+
+static void manchester_sample(manchester_rx &rx, int level) {
+  rx.time++;
+  if (level == rx.level) {
+    // no mid-bit edge for more than a bit: end of the transmission
+    if (rx.sync && (rx.time - rx.edge > 1.5 * rx.samples_per_bit))
+      rx.sync = false;
+    return;
+  }
+  rx.level = level;
+  if (!rx.sync) {
+    if (level) {
+      rx.sync = true;
+      rx.edge = rx.time;
+      rx.value = 0;
+      rx.bits = 0;
+      manchester_bit(rx, 1);
+    }
+    return;
+  }
+  // bit boundary
+  if (rx.time - rx.edge < 0.75 * rx.samples_per_bit)
+    return;
+  rx.edge = rx.time;
+  manchester_bit(rx, level);
+}
+
+static void usage() {
+  fprintf(stderr,
+    "usage: telemetry [options] [device or file]\n"
+    "  -m rate      Manchester coded optical readout sampled at rate (Hz)\n"
+    "  -b baud      bit rate of the optical readout (default: 500)\n"
+    "  -c channel   channel (bit) of the samples (default: 0)\n"
+    "  -i           inverted signal (LED on is 0)\n");
+}
+
+int main(int argc, char **argv) {
+  FILE *in = stdin;
+  unsigned long samplerate = 0;
+  unsigned long baud = 500;
+  unsigned int channel = 0;
+  bool invert = false;
+
+  int opt;
+  while ((opt = getopt(argc, argv, "m:b:c:ih")) != -1) {
+    switch (opt) {
+    case 'm':
+      samplerate = strtoul(optarg, NULL, 10);
+      break;
+    case 'b':
+      baud = strtoul(optarg, NULL, 10);
+      break;
+    case 'c':
+      channel = strtoul(optarg, NULL, 10);
+      break;
+    case 'i':
+      invert = true;
+      break;
+    default:
+      usage();
+      return 1;
+    }
+  }
+  if ((argc - optind > 1) || (channel > 7) || (samplerate && (!baud || samplerate < 4 * baud))) {
+    usage();
+    return 1;
+  }
+  if (optind < argc) {
+    in = fopen(argv[optind], "rb");
+    if (!in) {
+      perror(argv[optind]);
+      return 1;
+    }
+  }
+
+  manchester_rx rx;
+  memset(&rx, 0, sizeof(rx));
+  rx.samples_per_bit = (double) samplerate / baud;
+
+  int c;
+  while ((c = fgetc(in)) != EOF) {
+    if (samplerate)
+      manchester_sample(rx, ((c >> channel) & 1) ^ (invert ? 1 : 0));
+    else
+      feed(c);
+    fflush(stdout);
+  }
+  return 0;
+}